@@ -7,6 +7,32 @@
 #include <fstream>
 #include <cstdint>
 #include <algorithm>
+#include <memory>
+#include <atomic>
+#include <bitset>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cerrno>
+#include <thread>
+#include <unistd.h>
+#if defined(STATS_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#ifdef SCHED
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <fcntl.h>
+#include <poll.h>
+#endif
+#if defined(LOCKSTEP) && (defined(__AVX2__) || defined(__AVX512F__))
+#include <immintrin.h>
+#endif
 
 void inline log_error(const std::string err, const uint32_t x) {
   std::cerr << "[ERROR] " << err << " 0x" << std::hex << x << std::endl;
@@ -24,6 +50,295 @@ void inline log_info(const std::string data) {
 #endif
 }
 
+// Emulator self-instrumentation. Everything below compiles to nothing unless
+// built with -DSTATS (see `make stats`). Counters describe the host side of
+// the emulator (what it spends its time on), not the guest program.
+#ifdef STATS
+// Sample one in STATS_SAMPLE_PERIOD instructions with rdtsc when STATS_RDTSC
+// is defined; timing every instruction would dominate what we are measuring.
+constexpr uint64_t STATS_SAMPLE_PERIOD = 64;
+// How often (in retired instructions) the run loop polls for SIGUSR1.
+constexpr uint64_t STATS_POLL_PERIOD = 4096;
+
+// Written only by the thread that owns the Stats, but read by whichever
+// thread dumps them. Relaxed loads and stores keep that race-free and still
+// compile to plain moves, unlike an atomic increment.
+class StatsCounter {
+private:
+  std::atomic<uint64_t> _value{0};
+public:
+  operator uint64_t() const {
+    return this->_value.load(std::memory_order_relaxed);
+  }
+
+  StatsCounter& operator+=(uint64_t n) {
+    this->_value.store(this->_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    return *this;
+  }
+
+  void operator++(int) {
+    *this += 1;
+  }
+};
+
+class Stats {
+private:
+  StatsCounter _instret;
+  StatsCounter _opcodes[128];
+  StatsCounter _funct3[128][8];
+  StatsCounter _cycles[128];
+  StatsCounter _samples[128];
+  StatsCounter _decode_hits;
+  StatsCounter _decode_misses;
+  StatsCounter _code_writes;
+  StatsCounter _idiom_runs;
+  StatsCounter _idiom_insts;
+  StatsCounter _shared_hits;
+  StatsCounter _shared_misses;
+  uint64_t _next_poll = STATS_POLL_PERIOD;
+  std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+public:
+  void count(uint32_t opcode, uint32_t funct3, uint32_t n) {
+    this->_instret += n;
+    this->_opcodes[opcode & 0x7F] += n;
+    this->_funct3[opcode & 0x7F][(funct3 >> 12) & 0x7] += n;
+  }
+
+  void decode(bool hit) {
+    (hit ? this->_decode_hits : this->_decode_misses)++;
+  }
+
+  void code_write() {
+    this->_code_writes++;
+  }
+
+  void code_cache(bool hit) {
+    (hit ? this->_shared_hits : this->_shared_misses)++;
+  }
+
+  // Instructions retired by a bulk loop never reach execute(), so they are
+  // in instret but not in the opcode mix.
+  void idiom(uint32_t insts) {
+    this->_idiom_runs++;
+    this->_idiom_insts += insts;
+    this->_instret += insts;
+  }
+
+  void sample(uint32_t opcode, uint64_t cycles) {
+    this->_cycles[opcode & 0x7F] += cycles;
+    this->_samples[opcode & 0x7F]++;
+  }
+
+  uint64_t get_instret() const {
+    return this->_instret;
+  }
+
+  // True once per STATS_POLL_PERIOD instructions. instret can move by more
+  // than one at a time (lockstep groups, bulk loops), so this keeps its own
+  // threshold instead of testing instret for a multiple.
+  bool poll_due() {
+    if (this->_instret < this->_next_poll) {
+      return false;
+    }
+    this->_next_poll = this->_instret + STATS_POLL_PERIOD;
+    return true;
+  }
+
+  void merge(const Stats &other) {
+    this->_instret += other._instret;
+    this->_decode_hits += other._decode_hits;
+    this->_decode_misses += other._decode_misses;
+    this->_code_writes += other._code_writes;
+    this->_idiom_runs += other._idiom_runs;
+    this->_idiom_insts += other._idiom_insts;
+    this->_shared_hits += other._shared_hits;
+    this->_shared_misses += other._shared_misses;
+    for (int op = 0; op < 128; op++) {
+      this->_opcodes[op] += other._opcodes[op];
+      for (int f = 0; f < 8; f++) {
+        this->_funct3[op][f] += other._funct3[op][f];
+      }
+      this->_cycles[op] += other._cycles[op];
+      this->_samples[op] += other._samples[op];
+    }
+    this->_start = std::min(this->_start, other._start);
+  }
+
+  void dump_json(std::ostream &out) const {
+    auto elapsed = std::chrono::steady_clock::now() - this->_start;
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    out << std::dec << "{\"instret\":" << this->_instret
+        << ",\"host_ns\":" << ns
+        << ",\"host_ns_per_inst\":"
+        << (this->_instret ? (double)ns / this->_instret : 0.0)
+        << ",\"decode_cache\":{\"hits\":" << this->_decode_hits
+        << ",\"misses\":" << this->_decode_misses
+        << ",\"hit_rate\":" << (this->_decode_hits + this->_decode_misses
+                                ? (double)this->_decode_hits / (this->_decode_hits + this->_decode_misses)
+                                : 0.0)
+        << ",\"code_writes\":" << this->_code_writes
+        << ",\"shared_hits\":" << this->_shared_hits
+        << ",\"shared_misses\":" << this->_shared_misses << "}"
+        << ",\"idioms\":{\"runs\":" << this->_idiom_runs
+        << ",\"insts\":" << this->_idiom_insts << "}"
+        << ",\"opcodes\":{";
+    bool first = true;
+    for (int op = 0; op < 128; op++) {
+      if (this->_opcodes[op] == 0) continue;
+      out << (first ? "" : ",") << "\"0x" << std::hex << op << std::dec << "\":{"
+          << "\"count\":" << this->_opcodes[op] << ",\"funct3\":[";
+      for (int f = 0; f < 8; f++) {
+        out << (f ? "," : "") << this->_funct3[op][f];
+      }
+      out << "]";
+      if (this->_samples[op]) {
+        out << ",\"sampled\":" << this->_samples[op]
+            << ",\"cycles_per_inst\":" << (double)this->_cycles[op] / this->_samples[op];
+      }
+      out << "}";
+      first = false;
+    }
+    out << "}}" << std::endl;
+  }
+};
+
+// Counters are kept per host thread and summed when reported, so that
+// scheduler workers do not share cache lines on every instruction.
+static std::mutex g_stats_mutex;
+static std::vector<Stats*> g_stats_threads;
+// Lock-free, so safe to set from the signal handler; workers race to claim it.
+static std::atomic<bool> g_stats_dump_requested{false};
+
+static Stats& stats_local() {
+  thread_local Stats *stats = [] {
+    // NOTE: never freed, the exit report still needs threads that are gone.
+    Stats *s = new Stats();
+    std::lock_guard<std::mutex> lock(g_stats_mutex);
+    g_stats_threads.push_back(s);
+    return s;
+  }();
+  return *stats;
+}
+
+static void stats_dump() {
+  Stats total;
+  std::lock_guard<std::mutex> lock(g_stats_mutex);
+  for (Stats *s : g_stats_threads) {
+    total.merge(*s);
+  }
+  total.dump_json(std::cerr);
+}
+
+static void stats_on_sigusr1(int) {
+  g_stats_dump_requested.store(true, std::memory_order_relaxed);
+}
+
+static void stats_dump_at_exit() {
+  stats_dump();
+}
+#endif
+
+void inline stats_init() {
+#ifdef STATS
+  std::signal(SIGUSR1, stats_on_sigusr1);
+  std::atexit(stats_dump_at_exit);
+#endif
+}
+
+// n is the number of instructions retired, one per active lane in lockstep.
+void inline stats_count(const uint32_t opcode, const uint32_t funct3, const uint32_t n = 1) {
+#ifdef STATS
+  stats_local().count(opcode, funct3, n);
+#endif
+}
+
+// One block lookup in the decoded code cache.
+void inline stats_decode(const bool hit) {
+#ifdef STATS
+  stats_local().decode(hit);
+#endif
+}
+
+// A page lookup in the process-wide decoded code cache.
+void inline stats_code_cache(const bool hit) {
+#ifdef STATS
+  stats_local().code_cache(hit);
+#endif
+}
+
+// A store that hit a page holding decoded code.
+void inline stats_code_write() {
+#ifdef STATS
+  stats_local().code_write();
+#endif
+}
+
+// A loop run in bulk instead of instruction by instruction.
+void inline stats_idiom(const uint32_t insts) {
+#ifdef STATS
+  stats_local().idiom(insts);
+#endif
+}
+
+// Called from the run loop; only every STATS_POLL_PERIOD instructions does
+// it actually look at the signal flag.
+void inline stats_poll() {
+#ifdef STATS
+  if (stats_local().poll_due() && g_stats_dump_requested.load(std::memory_order_relaxed) &&
+      g_stats_dump_requested.exchange(false)) {
+    stats_dump();
+  }
+#endif
+}
+
+uint64_t inline stats_sample_begin() {
+#if defined(STATS) && defined(STATS_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+  if (stats_local().get_instret() % STATS_SAMPLE_PERIOD == 0) {
+    return __rdtsc();
+  }
+#endif
+  return 0;
+}
+
+void inline stats_sample_end(const uint32_t opcode, const uint64_t begin) {
+#if defined(STATS) && defined(STATS_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+  if (begin != 0) {
+    stats_local().sample(opcode, __rdtsc() - begin);
+  }
+#endif
+}
+
+// Edge coverage for the fuzzing harness, compiled in with -DFUZZ. Control
+// transfers are hashed like AFL instruments basic blocks: the destination is
+// the current location and the previous destination, shifted, is xored in.
+#ifdef FUZZ
+constexpr uint32_t FUZZ_MAP_SIZE = 1 << 16;
+// libFuzzer collects counters placed in this section on its own.
+__attribute__((used, section("__libfuzzer_extra_counters")))
+static uint8_t g_coverage[FUZZ_MAP_SIZE];
+static uint32_t g_coverage_prev = 0;
+#endif
+
+void inline coverage_edge(const uint32_t to) {
+#ifdef FUZZ
+  uint32_t cur = to * 0x9E3779B1u;
+  cur = (cur ^ (cur >> 16)) & (FUZZ_MAP_SIZE - 1);
+  g_coverage[cur ^ g_coverage_prev]++;
+  g_coverage_prev = cur >> 1;
+#endif
+}
+
+// The same edge taken count times in a row, as a loop run in bulk would have
+// recorded it. Counters wrap like the byte counters they are.
+void inline coverage_edge_repeat(const uint32_t to, const uint32_t count) {
+#ifdef FUZZ
+  uint32_t n = count % 256 == 0 && count ? 256 : count % 256;
+  for (uint32_t i = 0; i < n; i++) {
+    coverage_edge(to);
+  }
+#endif
+}
+
 constexpr int32_t sext(int32_t imm, int bits) {
   int sign_pos = bits - 1;
   if (imm & (1 << sign_pos)) {
@@ -159,12 +474,39 @@ public:
 
 };
 
+constexpr uint32_t RAM_WORDS = 1024 * 1024 * 4;
+constexpr uint32_t PAGE_SHIFT = 10;
+constexpr uint32_t PAGE_WORDS = 1 << PAGE_SHIFT;
+constexpr uint32_t RAM_PAGES = RAM_WORDS / PAGE_WORDS;
+
 class Ram {
 private:
-  uint32_t _data[1024 * 1024 * 4];
+  uint32_t _data[RAM_WORDS];
+#ifdef FUZZ
+  // Pages written since the last snapshot; restore() copies only these back.
+  std::vector<uint32_t> _snapshot;
+  std::vector<bool> _dirty = std::vector<bool>(RAM_PAGES);
+  std::vector<uint32_t> _dirty_pages;
+
+  void mark_dirty(uint32_t addr) {
+    uint32_t page = addr >> PAGE_SHIFT;
+    if (!this->_dirty[page]) {
+      this->_dirty[page] = true;
+      this->_dirty_pages.push_back(page);
+    }
+  }
+
+  void mark_dirty_range(uint32_t addr, uint32_t count, uint32_t stride) {
+    if (count == 0) return;
+    uint32_t last = addr + (count - 1) * stride;
+    for (uint32_t page = addr >> PAGE_SHIFT; page <= last >> PAGE_SHIFT; page++) {
+      this->mark_dirty(page << PAGE_SHIFT);
+    }
+  }
+#endif
 
   bool is_valid(uint32_t addr) const {
-    return addr >= 0 || addr < (1024 * 1024 * 4);
+    return addr < RAM_WORDS;
   }
 public:
   // OR instruction
@@ -172,7 +514,7 @@ public:
 
   uint32_t read(uint32_t addr) const {
     if (this->is_valid(addr)) {
-      return this->_data[addr];
+      return this->read_unchecked(addr);
     }
     log_error("[READ] Invalid address", addr);
     exit(1);
@@ -180,134 +522,1159 @@ public:
 
   void write(uint32_t addr, uint32_t data) {
     if (this->is_valid(addr)) { 
-      this->_data[addr] = data;
+      this->write_unchecked(addr, data);
       return;
     }
     log_error("[WRITE] Invalid address", addr);
     exit(1);
   }
+
+  // For callers that already checked addr < RAM_WORDS.
+  uint32_t read_unchecked(uint32_t addr) const {
+    return this->_data[addr];
+  }
+
+  void write_unchecked(uint32_t addr, uint32_t data) {
+#ifdef FUZZ
+    this->mark_dirty(addr);
+#endif
+    this->_data[addr] = data;
+  }
   
   void load(std::vector<uint32_t> payload) {
     for(uint32_t i = 0; i < payload.size(); i++) {
       write(i, payload.at(i));
     }
   }
+
+  // Bulk versions of what a guest loop does one word at a time, stepping
+  // stride words per iteration. Callers check that the range is valid.
+  void fill(uint32_t addr, uint32_t count, uint32_t stride, uint32_t val) {
+#ifdef FUZZ
+    this->mark_dirty_range(addr, count, stride);
+#endif
+    if (stride == 1) {
+      std::fill_n(this->_data + addr, count, val);
+      return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      this->_data[addr + i * stride] = val;
+    }
+  }
+
+  // Same result as copying forward one element at a time, which for
+  // dst <= src is also what std::copy does.
+  void copy(uint32_t dst, uint32_t src, uint32_t count, uint32_t stride, uint32_t mask) {
+#ifdef FUZZ
+    this->mark_dirty_range(dst, count, stride);
+#endif
+    if (stride == 1 && mask == 0xFFFFFFFF) {
+      std::copy_n(this->_data + src, count, this->_data + dst);
+      return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      this->_data[dst + i * stride] = this->_data[src + i * stride] & mask;
+    }
+  }
+
+  // Index of the first element whose masked value is (or, with equal set to
+  // false, is not) val; count if there is none.
+  uint32_t find(uint32_t addr, uint32_t count, uint32_t stride, uint32_t mask, uint32_t val, bool equal) const {
+    uint32_t i = 0;
+    if (stride == 1) {
+      // Branch-free chunks so the compiler can vectorize the compare.
+      constexpr uint32_t CHUNK = 16;
+      const uint32_t *data = this->_data + addr;
+      for (; i + CHUNK <= count; i += CHUNK) {
+        bool hit = false;
+        for (uint32_t j = 0; j < CHUNK; j++) {
+          hit |= ((data[i + j] & mask) == val) == equal;
+        }
+        if (hit) break;
+      }
+    }
+    for (; i < count; i++) {
+      if (((this->_data[addr + i * stride] & mask) == val) == equal) break;
+    }
+    return i;
+  }
+
+#ifdef FUZZ
+  const std::vector<uint32_t>& get_dirty_pages() const {
+    return this->_dirty_pages;
+  }
+
+  uint32_t read_snapshot(uint32_t addr) const {
+    return this->_snapshot[addr];
+  }
+
+  void snapshot() {
+    this->_snapshot.assign(this->_data, this->_data + RAM_WORDS);
+    for (uint32_t page : this->_dirty_pages) {
+      this->_dirty[page] = false;
+    }
+    this->_dirty_pages.clear();
+  }
+
+  void restore() {
+    for (uint32_t page : this->_dirty_pages) {
+      uint32_t base = page << PAGE_SHIFT;
+      std::copy_n(this->_snapshot.begin() + base, PAGE_WORDS, this->_data + base);
+      this->_dirty[page] = false;
+    }
+    this->_dirty_pages.clear();
+  }
+#endif
 };
 
-class Instruction {
+// Memory mapped devices. Addresses are word addresses like everything else,
+// so register offsets are in words. Everything at or above RAM_WORDS goes
+// through the Bus; RAM accesses only pay the bounds check they always had.
+constexpr uint32_t CLINT_BASE  = 0x02000000;
+constexpr uint32_t CLINT_WORDS = 0x4000;
+constexpr uint32_t UART_BASE   = 0x10000000;
+constexpr uint32_t TEST_BASE   = 0x10100000;
+// Bytes the UART collects before it writes even without a newline.
+constexpr uint32_t UART_BUFFER = 4096;
+
+class Device {
+public:
+  virtual ~Device() = default;
+  virtual uint32_t read(uint32_t offset) = 0;
+  virtual void write(uint32_t offset, uint32_t val) = 0;
+#ifdef FUZZ
+  // Device registers are part of the fuzzing snapshot like RAM.
+  virtual void snapshot() { }
+  virtual void restore() { }
+#endif
+};
+
+// 16550 registers, one per word.
+enum {
+  UART_RBR = 0, // THR on write, DLL with DLAB set
+  UART_IER = 1, // DLM with DLAB set
+  UART_IIR = 2, // FCR on write
+  UART_LCR = 3,
+  UART_MCR = 4,
+  UART_LSR = 5,
+  UART_MSR = 6,
+  UART_SCR = 7,
+
+  UART_LCR_DLAB = 0x80,
+  UART_LSR_THRE = 0x20,
+  UART_LSR_TEMT = 0x40,
+  UART_IIR_NO_INT = 0x01,
+};
+
+class Uart;
+
+// Every live UART, so that output still buffered when the process exits
+// (a guest error ends in exit(1)) is written out by uart_flush_all().
+static std::mutex g_uarts_mutex;
+static std::vector<Uart*> g_uarts;
+static void uart_flush_all();
+
+// Transmit only 16550. Characters are collected and written to the host in
+// one write() per line, per UART_BUFFER bytes or when flushed at exit.
+class Uart : public Device {
 private:
-  uint32_t _value;
+  int _fd = STDOUT_FILENO;
+  // Set when the owner writes the output itself, see take().
+  bool _deferred = false;
+  std::string _out;
+  uint8_t _regs[8] = {0};
+  uint8_t _dll = 0;
+  uint8_t _dlm = 0;
+#ifdef FUZZ
+  std::string _saved_out;
+  uint8_t _saved_regs[8] = {0};
+  uint8_t _saved_dll = 0;
+  uint8_t _saved_dlm = 0;
+#endif
+
 public:
-  Instruction(uint32_t value) {
-    this->_value = value;
+  Uart() {
+    static bool registered = (std::atexit(uart_flush_all), true);
+    (void)registered;
+    std::lock_guard<std::mutex> lock(g_uarts_mutex);
+    g_uarts.push_back(this);
   }
 
-  uint32_t get_value() const {
-    return this->_value;
+  ~Uart() {
+    this->flush();
+    std::lock_guard<std::mutex> lock(g_uarts_mutex);
+    std::erase(g_uarts, this);
   }
 
-  uint32_t get_opcode() const {
-    return this->_value & 0b00000000000000000000000001111111;
+  // -1 discards output.
+  void set_output(int fd) {
+    this->flush();
+    this->_fd = fd;
   }
-  
-  uint32_t get_rd() const {
-    return (this->_value & 0b00000000000000000000111110000000) >> 7;
+
+  int get_output() const {
+    return this->_fd;
   }
 
-  uint32_t get_funct3() const {
-    return this->_value & 0b00000000000000000111000000000000;
+  // Stops the UART from writing on its own; the owner collects the output
+  // with take() and writes it where blocking is allowed.
+  void set_deferred(bool deferred) {
+    this->_deferred = deferred;
   }
 
-  uint32_t get_rs1() const {
-    return (this->_value & 0b00000000000011111000000000000000) >> 15;
+  std::string take() {
+    std::string out;
+    out.swap(this->_out);
+    return out;
   }
 
-  uint32_t get_rs2() const {
-    return (this->_value & 0b00000001111100000000000000000000) >> 20;
+  void flush() {
+    if (!this->_out.empty() && this->_fd >= 0) {
+      ssize_t n = ::write(this->_fd, this->_out.data(), this->_out.size());
+      (void)n;
+    }
+    this->_out.clear();
   }
 
-  uint32_t get_funct7() const {
-    return this->_value & 0b11111110000000000000000000000000;
+  uint32_t read(uint32_t offset) override {
+    bool dlab = this->_regs[UART_LCR] & UART_LCR_DLAB;
+    switch(offset) {
+      case UART_RBR: return dlab ? this->_dll : 0;
+      case UART_IER: return dlab ? this->_dlm : this->_regs[UART_IER];
+      case UART_IIR: return UART_IIR_NO_INT;
+      case UART_LSR: return UART_LSR_THRE | UART_LSR_TEMT;
+      case UART_LCR:
+      case UART_MCR:
+      case UART_MSR:
+      case UART_SCR: return this->_regs[offset];
+      default: return 0;
+    }
   }
 
-  uint32_t get_imm31_12() const {
-    return (this->_value & 0b11111111111111111111000000000000) >> 12;
+  void write(uint32_t offset, uint32_t val) override {
+    bool dlab = this->_regs[UART_LCR] & UART_LCR_DLAB;
+    switch(offset) {
+      case UART_RBR: {
+        if (dlab) {
+          this->_dll = val;
+          break;
+        }
+        this->_out.push_back((char)val);
+        if (!this->_deferred && ((char)val == '\n' || this->_out.size() >= UART_BUFFER)) {
+          this->flush();
+        }
+        break;
+      }
+      case UART_IER: {
+        (dlab ? this->_dlm : this->_regs[UART_IER]) = val;
+        break;
+      }
+      case UART_IIR:
+      case UART_LSR:
+      case UART_MSR: {
+        break;
+      }
+      case UART_LCR:
+      case UART_MCR:
+      case UART_SCR: {
+        this->_regs[offset] = val;
+        break;
+      }
+    }
   }
 
-  uint32_t get_imm11_0() const {
-    return (this->_value & 0b11111111111100000000000000000000) >> 20;
+#ifdef FUZZ
+  void snapshot() override {
+    this->_saved_out = this->_out;
+    std::copy_n(this->_regs, 8, this->_saved_regs);
+    this->_saved_dll = this->_dll;
+    this->_saved_dlm = this->_dlm;
   }
 
-  uint32_t get_imm_store() const {
-    return ((this->_value & 0b11111111000000000000000000000000) >> 25) |
-           ((this->_value & 0b00000000000000000000111110000000) >> 7);
+  void restore() override {
+    this->_out = this->_saved_out;
+    std::copy_n(this->_saved_regs, 8, this->_regs);
+    this->_dll = this->_saved_dll;
+    this->_dlm = this->_saved_dlm;
   }
+#endif
+};
 
-  uint32_t get_imm_branch() const {
-    return ((this->_value & 0b10000000000000000000000000000000) >> 19) |
-           ((this->_value & 0b01111110000000000000000000000000) >> 20) |
-           (((this->_value & 0b00000000000000000000111100000000) >> 7) & 0x1E) | // NOTE: & 0x1E is becauce bit at 0 position is alawys 0.
-           ((this->_value & 0b00000000000000000000000010000000) << 4);
+static void uart_flush_all() {
+  std::lock_guard<std::mutex> lock(g_uarts_mutex);
+  for (Uart *uart : g_uarts) {
+    uart->flush();
   }
-  
-  uint32_t get_pred() const {
-    return this->_value & 0b00001111000000000000000000000000;
+}
+
+enum {
+  TEST_FAIL  = 0x3333,
+  TEST_PASS  = 0x5555,
+  TEST_RESET = 0x7777,
+};
+
+// Like QEMU's sifive_test: writing PASS exits with 0, FAIL | code << 16
+// exits with code.
+class TestDevice : public Device {
+private:
+  std::function<void(uint32_t)> _exit;
+
+public:
+  TestDevice(std::function<void(uint32_t)> exit) : _exit(std::move(exit)) { }
+
+  uint32_t read(uint32_t offset) override {
+    return 0;
   }
 
-  uint32_t get_succ() const {
-    return this->_value & 0b00000000111100000000000000000000;
+  void write(uint32_t offset, uint32_t val) override {
+    if (offset != 0) return;
+    switch(val & 0xFFFF) {
+      case TEST_PASS: {
+        this->_exit(0);
+        break;
+      }
+      case TEST_FAIL: {
+        this->_exit(val >> 16);
+        break;
+      }
+      default: {
+        log_error("[TEST] Unsupported command", val);
+      }
+    }
   }
 };
 
-class RV32I {
+enum {
+  CLINT_MSIP       = 0x0,
+  CLINT_MTIMECMP   = 0x1000,
+  CLINT_MTIMECMPH  = 0x1001,
+  CLINT_MTIME      = 0x2FFE,
+  CLINT_MTIMEH     = 0x2FFF,
+};
+
+// mtime counts retired instructions. msip and mtimecmp are kept but raise
+// nothing, there are no interrupts to deliver.
+class Clint : public Device {
 private:
-  Registers _regs;
-  Ram _ram;
+  const uint32_t *_instret;
+  uint32_t _msip = 0;
+  uint64_t _mtimecmp = ~0ull;
+#ifdef FUZZ
+  uint32_t _saved_msip = 0;
+  uint64_t _saved_mtimecmp = ~0ull;
+#endif
 
-  Instruction* instruction_fetch() {
-    uint32_t value = _ram.read(_regs.get_pc());
-    _regs.increment_pc();
-    Instruction* inst = new Instruction(value);
-    return inst;
-  }
+public:
+  Clint(const uint32_t *instret) : _instret(instret) { }
 
-  void execute(Instruction &inst) {
-    uint32_t opcode = inst.get_opcode();
-    if (opcode != 0x0) {
-      log_debug_hex("opcode", opcode);
+  uint32_t read(uint32_t offset) override {
+    switch(offset) {
+      case CLINT_MSIP: return this->_msip;
+      case CLINT_MTIMECMP: return (uint32_t)this->_mtimecmp;
+      case CLINT_MTIMECMPH: return (uint32_t)(this->_mtimecmp >> 32);
+      case CLINT_MTIME: return *this->_instret;
+      case CLINT_MTIMEH: return 0;
+      default: return 0;
     }
-    switch(opcode) {
-      case OPCODE_LUI: {
-        log_info("opcode lui");
-        uint32_t rd = inst.get_rd();
-        uint32_t imm = inst.get_imm31_12();
-        log_debug_hex("rd", rd);
-        log_debug_hex("imm", imm);
-        // TODO: verify if correct.
-        _regs[rd] = sext(imm, 20);
+  }
+
+  void write(uint32_t offset, uint32_t val) override {
+    switch(offset) {
+      case CLINT_MSIP: {
+        this->_msip = val & 1;
         break;
       }
-      case OPCODE_AUIPC: {
-        log_info("opcode auipc");
-        uint32_t rd = inst.get_rd();
-        uint32_t imm = inst.get_imm31_12();
-        log_debug_hex("rd", rd);
-        log_debug_hex("imm", imm);
-        // TODO: verify if correct.
-        _regs[rd] = (uint32_t)sext(imm, 20) + _regs.get_pc();
+      case CLINT_MTIMECMP: {
+        this->_mtimecmp = (this->_mtimecmp & 0xFFFFFFFF00000000ull) | val;
         break;
       }
-      case OPCODE_JAL: {
-        log_info("opcode jal");
-        uint32_t rd = inst.get_rd();
-        uint32_t imm = inst.get_imm31_12();
-        log_debug_hex("rd", rd);
-        log_debug_hex("imm", imm);
-        // TODO: verify if correct.
-        _regs[rd] = _regs.get_pc() + 1; // NOTE: Originally 4 is added.
-        uint32_t offset = (uint32_t)sext(imm, 20);
+      case CLINT_MTIMECMPH: {
+        this->_mtimecmp = (this->_mtimecmp & 0xFFFFFFFFull) | ((uint64_t)val << 32);
+        break;
+      }
+    }
+  }
+
+#ifdef FUZZ
+  // mtime is instret, which RV32I restores itself.
+  void snapshot() override {
+    this->_saved_msip = this->_msip;
+    this->_saved_mtimecmp = this->_mtimecmp;
+  }
+
+  void restore() override {
+    this->_msip = this->_saved_msip;
+    this->_mtimecmp = this->_saved_mtimecmp;
+  }
+#endif
+};
+
+// Resolves device addresses one page at a time: a two level table of
+// region numbers, with second level tables only where something is mapped.
+class Bus {
+private:
+  static constexpr uint32_t L2_BITS = 12;
+  static constexpr uint32_t L1_SIZE = 1 << (32 - PAGE_SHIFT - L2_BITS);
+
+  struct Region {
+    uint32_t base;
+    Device *device;
+  };
+
+  std::vector<Region> _regions;
+  // Region number + 1 for every mapped page.
+  std::unique_ptr<uint8_t[]> _pages[L1_SIZE];
+
+  const Region* lookup(uint32_t addr) const {
+    uint32_t page = addr >> PAGE_SHIFT;
+    const uint8_t *table = this->_pages[page >> L2_BITS].get();
+    if (table == nullptr || table[page & ((1 << L2_BITS) - 1)] == 0) {
+      return nullptr;
+    }
+    return &this->_regions[table[page & ((1 << L2_BITS) - 1)] - 1];
+  }
+
+public:
+  // base and words are rounded out to whole pages.
+  void map(uint32_t base, uint32_t words, Device *device) {
+    this->_regions.push_back(Region{base, device});
+    uint32_t first = base >> PAGE_SHIFT;
+    uint32_t last = (base + words - 1) >> PAGE_SHIFT;
+    for (uint32_t page = first; page <= last; page++) {
+      auto &table = this->_pages[page >> L2_BITS];
+      if (!table) {
+        table = std::make_unique<uint8_t[]>(1 << L2_BITS);
+      }
+      table[page & ((1 << L2_BITS) - 1)] = this->_regions.size();
+    }
+  }
+
+  uint32_t read(uint32_t addr) const {
+    const Region *region = this->lookup(addr);
+    if (region == nullptr) {
+      log_error("[READ] Invalid address", addr);
+      exit(1);
+    }
+    return region->device->read(addr - region->base);
+  }
+
+  void write(uint32_t addr, uint32_t val) {
+    const Region *region = this->lookup(addr);
+    if (region == nullptr) {
+      log_error("[WRITE] Invalid address", addr);
+      exit(1);
+    }
+    region->device->write(addr - region->base, val);
+  }
+
+#ifdef FUZZ
+  void snapshot() {
+    for (const Region &region : this->_regions) {
+      region.device->snapshot();
+    }
+  }
+
+  void restore() {
+    for (const Region &region : this->_regions) {
+      region.device->restore();
+    }
+  }
+#endif
+};
+
+class Instruction {
+private:
+  uint32_t _value;
+public:
+  Instruction(uint32_t value) {
+    this->_value = value;
+  }
+
+  uint32_t get_value() const {
+    return this->_value;
+  }
+
+  uint32_t get_opcode() const {
+    return this->_value & 0b00000000000000000000000001111111;
+  }
+  
+  uint32_t get_rd() const {
+    return (this->_value & 0b00000000000000000000111110000000) >> 7;
+  }
+
+  uint32_t get_funct3() const {
+    return this->_value & 0b00000000000000000111000000000000;
+  }
+
+  uint32_t get_rs1() const {
+    return (this->_value & 0b00000000000011111000000000000000) >> 15;
+  }
+
+  uint32_t get_rs2() const {
+    return (this->_value & 0b00000001111100000000000000000000) >> 20;
+  }
+
+  uint32_t get_funct7() const {
+    return this->_value & 0b11111110000000000000000000000000;
+  }
+
+  uint32_t get_imm31_12() const {
+    return (this->_value & 0b11111111111111111111000000000000) >> 12;
+  }
+
+  uint32_t get_imm11_0() const {
+    return (this->_value & 0b11111111111100000000000000000000) >> 20;
+  }
+
+  uint32_t get_imm_store() const {
+    return ((this->_value & 0b11111111000000000000000000000000) >> 25) |
+           ((this->_value & 0b00000000000000000000111110000000) >> 7);
+  }
+
+  uint32_t get_imm_branch() const {
+    return ((this->_value & 0b10000000000000000000000000000000) >> 19) |
+           ((this->_value & 0b01111110000000000000000000000000) >> 20) |
+           (((this->_value & 0b00000000000000000000111100000000) >> 7) & 0x1E) | // NOTE: & 0x1E is becauce bit at 0 position is alawys 0.
+           ((this->_value & 0b00000000000000000000000010000000) << 4);
+  }
+  
+  uint32_t get_pred() const {
+    return this->_value & 0b00001111000000000000000000000000;
+  }
+
+  uint32_t get_succ() const {
+    return this->_value & 0b00000000111100000000000000000000;
+  }
+};
+
+// Loops the decoder recognises and runs as one bulk memory operation, the
+// shapes newlib and libgcc use for memcpy, memset and strlen/memchr.
+enum IdiomKind {
+  IDIOM_COPY, // load, store of the loaded value, pointer increments, bne on a pointer or counter
+  IDIOM_FILL, // store of a loop invariant register, increments, bne on a pointer or counter
+  IDIOM_SCAN, // load, increments, bne/beq on the loaded value
+};
+
+// A loop that is a single block: instructions start..end of a page where
+// end is a branch back to start. Addresses are base register + offset +
+// k * stride in iteration k; offsets include increments done earlier in the
+// body.
+struct Idiom {
+  IdiomKind kind;
+  uint16_t start;
+  uint16_t length;
+  uint32_t stride[32];
+  uint8_t load_base;
+  uint8_t load_rd;
+  uint32_t load_offset;
+  uint32_t load_mask;
+  uint8_t store_base;
+  uint8_t store_src;
+  uint32_t store_offset;
+  uint32_t store_mask;
+  // Loop runs while test_reg != other_reg (bne), or == for beq on a scan.
+  uint8_t test_reg;
+  uint8_t other_reg;
+  bool exit_on_equal;
+};
+
+// Decoded instructions of one RAM page. A block starting at offset o runs
+// up to and including block_end(o): the first instruction that may change
+// the pc (branch, jump, SYSTEM, FENCE.I) or the last word of the page.
+class DecodedPage {
+private:
+  uint32_t _base;
+  std::vector<Instruction> _insts;
+  uint16_t _block_end[PAGE_WORDS];
+  // Loop idioms by the offset of their closing branch.
+  std::unordered_map<uint16_t, Idiom> _idioms;
+  std::bitset<PAGE_WORDS> _has_idiom;
+
+  static bool ends_block(const Instruction &inst) {
+    switch(inst.get_opcode()) {
+      case OPCODE_JAL:
+      case OPCODE_JALR:
+      case OPCODE_BRANCH:
+      case OPCODE_R:
+        return true;
+      case OPCODE_FENCE:
+        return inst.get_funct3() == FUNCT3_FENCEI;
+      default:
+        return false;
+    }
+  }
+
+  // Recomputes block ends for offset and every block running into it.
+  void update_block_ends(uint32_t offset) {
+    uint16_t end = offset;
+    if (!ends_block(this->_insts[offset]) && offset + 1 < PAGE_WORDS) {
+      end = this->_block_end[offset + 1];
+    }
+    this->_block_end[offset] = end;
+    for (int32_t o = (int32_t)offset - 1; o >= 0 && !ends_block(this->_insts[o]); o--) {
+      this->_block_end[o] = end;
+    }
+  }
+
+  static uint32_t load_mask(uint32_t funct3) {
+    switch(funct3) {
+      case FUNCT3_LOAD_BYTE:
+      case FUNCT3_LOAD_BYTE_U: return 0x000000FF;
+      case FUNCT3_LOAD_HALF:
+      case FUNCT3_LOAD_HALF_U: return 0x0000FFFF;
+      default: return 0xFFFFFFFF;
+    }
+  }
+
+  // Same masks RV32I::execute applies to stored values.
+  static uint32_t store_mask(uint32_t funct3) {
+    switch(funct3) {
+      case FUNCT3_STORE_BYTE: return 0b00000000000000000000000001111111;
+      case FUNCT3_STORE_HALF: return 0b00000000000000001111111111111111;
+      default: return 0xFFFFFFFF;
+    }
+  }
+
+  // Matches the body start..end-1 against the idiom shapes. Anything other
+  // than one load, one store and addi increments of a register to itself
+  // is rejected.
+  bool match(uint32_t start, uint32_t end, Idiom &idiom) const {
+    bool has_load = false;
+    bool has_store = false;
+    for (uint32_t o = start; o < end; o++) {
+      const Instruction &inst = this->_insts[o];
+      uint32_t rd = inst.get_rd();
+      uint32_t rs1 = inst.get_rs1();
+      switch(inst.get_opcode()) {
+        case OPCODE_INT_COMP_I: {
+          if (inst.get_funct3() != FUNCT3_ADDI || rd != rs1 || rd == 0) return false;
+          idiom.stride[rd] += sext(inst.get_imm11_0(), 12);
+          break;
+        }
+        case OPCODE_LOAD: {
+          if (has_load || has_store || rd == 0) return false;
+          has_load = true;
+          idiom.load_base = rs1;
+          idiom.load_rd = rd;
+          idiom.load_offset = idiom.stride[rs1] + sext(inst.get_imm11_0(), 12);
+          idiom.load_mask = load_mask(inst.get_funct3());
+          break;
+        }
+        case OPCODE_STORE: {
+          if (has_store) return false;
+          has_store = true;
+          idiom.store_base = rs1;
+          idiom.store_src = inst.get_rs2();
+          idiom.store_offset = idiom.stride[rs1] + sext(inst.get_imm_store(), 12);
+          idiom.store_mask = store_mask(inst.get_funct3());
+          break;
+        }
+        default:
+          return false;
+      }
+    }
+    auto invariant = [&](uint32_t r) { return idiom.stride[r] == 0 && !(has_load && r == idiom.load_rd); };
+    auto pointer = [&](uint32_t r) { return (int32_t)idiom.stride[r] > 0; };
+    const Instruction &branch = this->_insts[end];
+    uint32_t rs1 = branch.get_rs1();
+    uint32_t rs2 = branch.get_rs2();
+    idiom.test_reg = invariant(rs1) ? rs2 : rs1;
+    idiom.other_reg = invariant(rs1) ? rs1 : rs2;
+    if (!invariant(idiom.other_reg)) return false;
+    idiom.exit_on_equal = branch.get_funct3() == FUNCT3_BNE;
+    if (has_load && (!pointer(idiom.load_base) || idiom.stride[idiom.load_rd] != 0)) return false;
+    if (has_store && !pointer(idiom.store_base)) return false;
+    if (has_load && has_store) {
+      idiom.kind = IDIOM_COPY;
+      if (idiom.store_src != idiom.load_rd || idiom.stride[idiom.load_base] != idiom.stride[idiom.store_base]) return false;
+    } else if (has_store) {
+      idiom.kind = IDIOM_FILL;
+      if (!invariant(idiom.store_src)) return false;
+    } else if (has_load) {
+      idiom.kind = IDIOM_SCAN;
+      return idiom.test_reg == idiom.load_rd;
+    } else {
+      return false;
+    }
+    return idiom.exit_on_equal && idiom.stride[idiom.test_reg] != 0;
+  }
+
+  // Looks for an idiom closed by the branch at end, replacing what was
+  // recorded there before.
+  void analyze(uint32_t end) {
+    if (this->_has_idiom[end]) {
+      this->_idioms.erase(end);
+      this->_has_idiom[end] = false;
+    }
+    const Instruction &branch = this->_insts[end];
+    if (branch.get_opcode() != OPCODE_BRANCH ||
+        (branch.get_funct3() != FUNCT3_BNE && branch.get_funct3() != FUNCT3_BEQ)) {
+      return;
+    }
+    // Mirrors Registers::increment_pc_by_offset.
+    uint32_t next = this->_base + end + 1;
+    uint32_t target = next + next + sext(branch.get_imm_branch(), 12);
+    if (target < this->_base || target >= this->_base + end) {
+      return;
+    }
+    uint32_t start = target - this->_base;
+    for (uint32_t o = start; o < end; o++) {
+      if (ends_block(this->_insts[o])) return;
+    }
+    Idiom idiom = {};
+    idiom.start = start;
+    idiom.length = end - start + 1;
+    if (this->match(start, end, idiom)) {
+      this->_idioms[end] = idiom;
+      this->_has_idiom[end] = true;
+    }
+  }
+
+public:
+  DecodedPage(const Ram &ram, uint32_t base) : _base(base) {
+    this->_insts.reserve(PAGE_WORDS);
+    for (uint32_t i = 0; i < PAGE_WORDS; i++) {
+      this->_insts.emplace_back(ram.read(base + i));
+    }
+    uint16_t end = PAGE_WORDS - 1;
+    for (int32_t o = PAGE_WORDS - 1; o >= 0; o--) {
+      if (ends_block(this->_insts[o])) {
+        end = o;
+        this->analyze(o);
+      }
+      this->_block_end[o] = end;
+    }
+  }
+
+  // The idiom the block starting at offset runs as, if any.
+  const Idiom* idiom(uint32_t offset) const {
+    uint32_t end = this->_block_end[offset];
+    if (!this->_has_idiom[end]) {
+      return nullptr;
+    }
+    const Idiom &idiom = this->_idioms.at(end);
+    return idiom.start == offset ? &idiom : nullptr;
+  }
+
+  const Instruction& get(uint32_t offset) const {
+    return this->_insts[offset];
+  }
+
+  uint32_t get_base() const {
+    return this->_base;
+  }
+
+  size_t memory_size() const {
+    return sizeof(DecodedPage) + this->_insts.capacity() * sizeof(Instruction) +
+           this->_idioms.size() * (sizeof(Idiom) + sizeof(uint16_t));
+  }
+
+  uint32_t block_end(uint32_t offset) const {
+    return this->_block_end[offset];
+  }
+
+  // Re-decodes a single word after a store into the page. Only the blocks
+  // that contain it change.
+  void patch(uint32_t offset, uint32_t value) {
+    bool was_end = ends_block(this->_insts[offset]);
+    uint32_t old_end = this->_block_end[offset];
+    this->_insts[offset] = Instruction(value);
+    if (ends_block(this->_insts[offset]) != was_end) {
+      this->update_block_ends(offset);
+    }
+    this->analyze(this->_block_end[offset]);
+    if (old_end != this->_block_end[offset]) {
+      this->analyze(old_end);
+    }
+  }
+};
+
+// Process-wide cache of decoded pages shared by every RV32I instance, so
+// guests running the same image decode its text once. Pages are keyed by
+// address and a hash of their contents and compared word by word on a hit.
+// Lookups never take a lock: a reader announces itself in _readers, and
+// evicted entries are only freed once no reader is in flight. Inserting and
+// evicting are serialised by _mutex. Capacity is CODE_CACHE_BYTES or
+// RV_CODE_CACHE_BYTES from the environment; entries still used by an
+// instance are never evicted.
+#ifndef CODE_CACHE_BYTES
+#define CODE_CACHE_BYTES (64 * 1024 * 1024)
+#endif
+
+// A decoded page as an instance holds it. Shared entries belong to
+// CodeCache and are reference counted; a page an instance has written to
+// becomes a private copy that never enters the cache.
+struct CodeEntry {
+  DecodedPage page;
+  uint64_t hash = 0;
+  bool shared = false;
+  // One reference is the cache's own; 0 means the entry is being evicted.
+  std::atomic<uint32_t> refs{1};
+  std::atomic<bool> used{true};
+
+  CodeEntry(const Ram &ram, uint32_t base) : page(ram, base) { }
+  explicit CodeEntry(const DecodedPage &page) : page(page) { }
+};
+
+class CodeCache {
+private:
+  static constexpr uint32_t SLOTS = 1 << 16;
+  static constexpr uint32_t MAX_PROBE = 64;
+
+  std::atomic<CodeEntry*> _slots[SLOTS] = {};
+  std::atomic<uint32_t> _readers{0};
+  std::mutex _mutex;
+  std::vector<CodeEntry*> _retired;
+  size_t _bytes = 0;
+  size_t _capacity = CODE_CACHE_BYTES;
+  uint32_t _hand = 0;
+
+  // Marks a slot whose entry was evicted; probing continues past it.
+  static CodeEntry* tombstone() {
+    static CodeEntry* const mark = reinterpret_cast<CodeEntry*>(alignof(CodeEntry));
+    return mark;
+  }
+
+  static uint64_t hash_page(const Ram &ram, uint32_t base) {
+    uint64_t h = 0xcbf29ce484222325ull ^ base;
+    for (uint32_t i = 0; i < PAGE_WORDS; i++) {
+      h = (h ^ ram.read(base + i)) * 0x100000001b3ull;
+    }
+    return h;
+  }
+
+  static bool matches(const CodeEntry *e, const Ram &ram, uint32_t base, uint64_t hash) {
+    if (e->hash != hash || e->page.get_base() != base) {
+      return false;
+    }
+    for (uint32_t i = 0; i < PAGE_WORDS; i++) {
+      if (e->page.get(i).get_value() != ram.read(base + i)) return false;
+    }
+    return true;
+  }
+
+  static bool try_ref(CodeEntry *e) {
+    uint32_t refs = e->refs.load();
+    while (refs != 0) {
+      if (e->refs.compare_exchange_weak(refs, refs + 1)) return true;
+    }
+    return false;
+  }
+
+  static size_t entry_bytes(const CodeEntry *e) {
+    return sizeof(CodeEntry) + e->page.memory_size();
+  }
+
+  CodeEntry* find(const Ram &ram, uint32_t base, uint64_t hash) {
+    this->_readers.fetch_add(1);
+    CodeEntry *found = nullptr;
+    for (uint32_t i = 0; i < MAX_PROBE; i++) {
+      CodeEntry *e = this->_slots[(hash + i) & (SLOTS - 1)].load();
+      if (e == nullptr) break;
+      if (e != tombstone() && matches(e, ram, base, hash) && try_ref(e)) {
+        e->used.store(true, std::memory_order_relaxed);
+        found = e;
+        break;
+      }
+    }
+    this->_readers.fetch_sub(1);
+    return found;
+  }
+
+  // Clock sweep over unreferenced entries until the cache fits again.
+  // Called with _mutex held.
+  void evict() {
+    for (uint32_t n = 0; n < 2 * SLOTS && this->_bytes > this->_capacity; n++) {
+      std::atomic<CodeEntry*> &slot = this->_slots[this->_hand++ & (SLOTS - 1)];
+      CodeEntry *e = slot.load();
+      if (e == nullptr || e == tombstone()) continue;
+      if (e->used.exchange(false, std::memory_order_relaxed)) continue;
+      uint32_t only_cache = 1;
+      if (!e->refs.compare_exchange_strong(only_cache, 0)) continue;
+      slot.store(tombstone());
+      this->_bytes -= entry_bytes(e);
+      this->_retired.push_back(e);
+    }
+    if (this->_readers.load() == 0) {
+      for (CodeEntry *e : this->_retired) delete e;
+      this->_retired.clear();
+    }
+  }
+
+public:
+  static CodeCache& instance() {
+    static CodeCache cache;
+    return cache;
+  }
+
+  void set_capacity(size_t bytes) {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    this->_capacity = bytes;
+    this->evict();
+  }
+
+  // Returns the decoded page at base with a reference for the caller.
+  CodeEntry* acquire(const Ram &ram, uint32_t base) {
+    uint64_t hash = hash_page(ram, base);
+    if (CodeEntry *e = this->find(ram, base, hash)) {
+      stats_code_cache(true);
+      return e;
+    }
+    stats_code_cache(false);
+    CodeEntry *fresh = new CodeEntry(ram, base);
+    fresh->hash = hash;
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    // Somebody may have decoded the same page while we did.
+    if (CodeEntry *e = this->find(ram, base, hash)) {
+      delete fresh;
+      return e;
+    }
+    for (uint32_t i = 0; i < MAX_PROBE; i++) {
+      std::atomic<CodeEntry*> &slot = this->_slots[(hash + i) & (SLOTS - 1)];
+      CodeEntry *e = slot.load();
+      if (e == nullptr || e == tombstone()) {
+        fresh->shared = true;
+        fresh->refs.store(2);
+        slot.store(fresh);
+        this->_bytes += entry_bytes(fresh);
+        this->evict();
+        return fresh;
+      }
+    }
+    // No room in this probe sequence, the caller keeps a private copy.
+    return fresh;
+  }
+
+  void release(CodeEntry *e) {
+    if (!e->shared) {
+      delete e;
+      return;
+    }
+    e->refs.fetch_sub(1);
+  }
+};
+
+// RV_CODE_CACHE_BYTES overrides CODE_CACHE_BYTES without a rebuild.
+void code_cache_init() {
+  if (const char *bytes = std::getenv("RV_CODE_CACHE_BYTES")) {
+    CodeCache::instance().set_capacity(std::stoull(bytes, nullptr, 0));
+  }
+}
+
+// Linux RISC-V syscall numbers, passed in a7.
+enum {
+  SYS_READ       = 63,
+  SYS_WRITE      = 64,
+  SYS_EXIT       = 93,
+  SYS_EXIT_GROUP = 94,
+  SYS_NANOSLEEP  = 101,
+};
+
+struct Syscall {
+  uint32_t number;
+  uint32_t args[3];
+};
+
+enum SliceResult {
+  SLICE_EXPIRED,
+  SLICE_SYSCALL,
+  SLICE_HALTED,
+};
+
+constexpr uint32_t MAX_INSTRUCTIONS = 100000;
+
+class RV32I {
+private:
+  Registers _regs;
+  Ram _ram;
+
+  uint32_t _instret = 0;
+  bool _halted = false;
+  uint32_t _exit_code = 0;
+  bool _syscall_pending = false;
+  Syscall _syscall;
+  Uart _uart;
+  TestDevice _test;
+  Clint _clint;
+  Bus _bus;
+
+  // Decoded pages, only for pages that code has been fetched from. A store
+  // to such a page patches the decoded copy; stores elsewhere only pay for
+  // the null check.
+  CodeEntry *_code[RAM_PAGES] = {};
+  // Set when the block being run may no longer match memory or the guest
+  // stopped; run_slice() then goes back to the block lookup.
+  bool _leave_block = false;
+
+  const DecodedPage& fetch_page(uint32_t pc) {
+    uint32_t page = pc >> PAGE_SHIFT;
+    if (page >= RAM_PAGES) {
+      log_error("[FETCH] Invalid address", pc);
+      exit(1);
+    }
+    if (!_code[page]) {
+      stats_decode(false);
+      _code[page] = CodeCache::instance().acquire(_ram, page << PAGE_SHIFT);
+    } else {
+      stats_decode(true);
+    }
+    return _code[page]->page;
+  }
+
+  // Keeps the decoded copy of a code page in sync with a write to it.
+  void patch_code(uint32_t addr, uint32_t val) {
+    CodeEntry *&entry = _code[addr >> PAGE_SHIFT];
+    uint32_t offset = addr & (PAGE_WORDS - 1);
+    if (entry->page.get(offset).get_value() == val) {
+      return;
+    }
+    if (entry->shared) {
+      // Copy on write, other instances keep running the shared page.
+      CodeEntry *own = new CodeEntry(entry->page);
+      CodeCache::instance().release(entry);
+      entry = own;
+    }
+    entry->page.patch(offset, val);
+  }
+
+  uint32_t load(uint32_t addr) {
+    if (addr < RAM_WORDS) {
+      return _ram.read_unchecked(addr);
+    }
+    return _bus.read(addr);
+  }
+
+  void store(uint32_t addr, uint32_t val) {
+    uint32_t page = addr >> PAGE_SHIFT;
+    if (page >= RAM_PAGES) {
+      _bus.write(addr, val);
+      return;
+    }
+    _ram.write_unchecked(addr, val);
+    if (_code[page]) {
+      stats_code_write();
+      patch_code(addr, val);
+      _leave_block = true;
+    }
+  }
+
+  bool in_ram(uint32_t addr, uint32_t count, uint32_t stride) const {
+    return (uint64_t)addr + (uint64_t)(count - 1) * stride < RAM_WORDS;
+  }
+
+  bool has_code(uint32_t addr, uint32_t count, uint32_t stride) const {
+    uint32_t last = addr + (count - 1) * stride;
+    for (uint32_t page = addr >> PAGE_SHIFT; page <= last >> PAGE_SHIFT; page++) {
+      if (_code[page]) return true;
+    }
+    return false;
+  }
+
+  // Runs as many whole iterations of the loop idiom at the pc as fit in
+  // max_insts and leaves registers, memory and pc as the interpreter would.
+  // Returns the instructions retired; 0 means the loop has to be
+  // interpreted (no whole iteration fits, the trip count is not a clean
+  // multiple, addresses leave RAM, copies overlap forward or stores would
+  // hit decoded code).
+  uint32_t run_idiom(const Idiom &idiom, uint32_t max_insts) {
+    uint32_t max_iters = max_insts / idiom.length;
+    if (max_iters == 0) {
+      return 0;
+    }
+    uint32_t iters;
+    bool exits;
+    if (idiom.kind == IDIOM_SCAN) {
+      uint32_t addr = _regs[idiom.load_base] + idiom.load_offset;
+      uint32_t stride = idiom.stride[idiom.load_base];
+      if (addr >= RAM_WORDS) {
+        return 0;
+      }
+      uint32_t limit = std::min(max_iters, (RAM_WORDS - 1 - addr) / stride + 1);
+      uint32_t found = _ram.find(addr, limit, stride, idiom.load_mask,
+                                 _regs[idiom.other_reg], idiom.exit_on_equal);
+      exits = found < limit;
+      iters = exits ? found + 1 : limit;
+      _regs[idiom.load_rd] = _ram.read_unchecked(addr + (iters - 1) * stride) & idiom.load_mask;
+    } else {
+      // First n >= 1 with test + n * stride == other.
+      int64_t distance = (int32_t)(_regs[idiom.other_reg] - _regs[idiom.test_reg]);
+      int64_t step = (int32_t)idiom.stride[idiom.test_reg];
+      if (distance % step != 0 || distance / step <= 0) {
+        return 0;
+      }
+      uint64_t trips = distance / step;
+      exits = trips <= max_iters;
+      iters = exits ? trips : max_iters;
+      uint32_t stride = idiom.stride[idiom.store_base];
+      uint32_t dst = _regs[idiom.store_base] + idiom.store_offset;
+      if (!in_ram(dst, iters, stride) || has_code(dst, iters, stride)) {
+        return 0;
+      }
+      if (idiom.kind == IDIOM_COPY) {
+        uint32_t src = _regs[idiom.load_base] + idiom.load_offset;
+        if (!in_ram(src, iters, stride) || (dst > src && dst <= src + (iters - 1) * stride)) {
+          return 0;
+        }
+        _regs[idiom.load_rd] = _ram.read_unchecked(src + (iters - 1) * stride) & idiom.load_mask;
+        _ram.copy(dst, src, iters, stride, idiom.load_mask & idiom.store_mask);
+      } else {
+        _ram.fill(dst, iters, stride, _regs[idiom.store_src] & idiom.store_mask);
+      }
+    }
+    for (uint8_t r = 1; r < 32; r++) {
+      _regs[r] += iters * idiom.stride[r];
+    }
+    uint32_t start = _regs.get_pc();
+    coverage_edge_repeat(start, exits ? iters - 1 : iters);
+    if (exits) {
+      _regs.set_pc(start + idiom.length);
+      coverage_edge(start + idiom.length);
+    }
+    uint32_t retired = iters * idiom.length;
+    _instret += retired;
+    stats_idiom(retired);
+    return retired;
+  }
+
+  void execute(const Instruction &inst) {
+    uint32_t opcode = inst.get_opcode();
+    stats_count(opcode, inst.get_funct3());
+    if (opcode != 0x0) {
+      log_debug_hex("opcode", opcode);
+    }
+    switch(opcode) {
+      case OPCODE_LUI: {
+        log_info("opcode lui");
+        uint32_t rd = inst.get_rd();
+        uint32_t imm = inst.get_imm31_12();
+        log_debug_hex("rd", rd);
+        log_debug_hex("imm", imm);
+        // TODO: verify if correct.
+        _regs[rd] = sext(imm, 20);
+        break;
+      }
+      case OPCODE_AUIPC: {
+        log_info("opcode auipc");
+        uint32_t rd = inst.get_rd();
+        uint32_t imm = inst.get_imm31_12();
+        log_debug_hex("rd", rd);
+        log_debug_hex("imm", imm);
+        // TODO: verify if correct.
+        _regs[rd] = (uint32_t)sext(imm, 20) + _regs.get_pc();
+        break;
+      }
+      case OPCODE_JAL: {
+        log_info("opcode jal");
+        uint32_t rd = inst.get_rd();
+        uint32_t imm = inst.get_imm31_12();
+        log_debug_hex("rd", rd);
+        log_debug_hex("imm", imm);
+        // TODO: verify if correct.
+        _regs[rd] = _regs.get_pc() + 1; // NOTE: Originally 4 is added.
+        uint32_t offset = (uint32_t)sext(imm, 20);
         log_info("JAL");
         _regs.increment_pc_by_offset(offset);
+        coverage_edge(_regs.get_pc());
         break;
       }
       case OPCODE_JALR: {
@@ -327,6 +1694,7 @@ private:
         uint32_t t = _regs.get_pc() + 1; 
         _regs.set_pc(jaddr);
         _regs[rd] = t;
+        coverage_edge(jaddr);
         break;
       }
       case OPCODE_BRANCH: {
@@ -393,6 +1761,8 @@ private:
             exit(1);
           }
         }
+        // NOTE: not taken branches are edges too, to the next instruction.
+        coverage_edge(_regs.get_pc());
         break;
       }
       case OPCODE_LOAD: {
@@ -411,27 +1781,27 @@ private:
         switch(funct3) {
           case FUNCT3_LOAD_BYTE: {
             log_info("LB");
-            _regs[rd] = _ram.read(addr) & 0x000000FF;
+            _regs[rd] = load(addr) & 0x000000FF;
             break;
           }
           case FUNCT3_LOAD_HALF: {
             log_info("LH");
-            _regs[rd] = _ram.read(addr) & 0x0000FFFF;
+            _regs[rd] = load(addr) & 0x0000FFFF;
             break;
           }
           case FUNCT3_LOAD_WORD: {
             log_info("LW");
-            _regs[rd] = _ram.read(addr) & 0xFFFFFFFF;
+            _regs[rd] = load(addr) & 0xFFFFFFFF;
             break;
           }
           case FUNCT3_LOAD_BYTE_U: {
             log_info("LBU");
-            _regs[rd] = _ram.read(addr) & 0x000000FF;
+            _regs[rd] = load(addr) & 0x000000FF;
             break;
           }
           case FUNCT3_LOAD_HALF_U: {
             log_info("LHU");
-            _regs[rd] = _ram.read(addr) & 0x0000FFFF;
+            _regs[rd] = load(addr) & 0x0000FFFF;
             break;
           }
           default: {
@@ -458,17 +1828,17 @@ private:
         switch(funct3) {
           case FUNCT3_STORE_BYTE: {
             uint32_t val = _regs[rs2] & 0b00000000000000000000000001111111;
-            _ram.write(addr, val);
+            store(addr, val);
             break;
           }
           case FUNCT3_STORE_HALF: {
             uint32_t val = _regs[rs2] & 0b00000000000000001111111111111111;
-            _ram.write(addr, val);
+            store(addr, val);
             break;
           }
           case FUNCT3_STORE_WORD: {
             uint32_t val = _regs[rs2];
-            _ram.write(addr, val);
+            store(addr, val);
             break;
           }
           default: {
@@ -674,80 +2044,653 @@ private:
               log_error("[FENCE2] Cannot decode instruction", inst.get_value());
               exit(1);
             }
-            throw std::runtime_error("Insctruion not implemented yet.");
+            // NOTE: stores already keep decoded pages in sync, FENCE.I only
+            // ends the block so the next fetch goes through the lookup.
+            log_info("FENCE.I");
             break;
           }
           default: {
-            log_error("[FENCE] Cannot decode instruction", inst.get_value());
+            log_error("[FENCE] Cannot decode instruction", inst.get_value());
+            exit(1);
+          }
+        }
+        break;
+      }
+      case OPCODE_R: {
+        log_info("opcode R");
+        uint32_t rd = inst.get_rd();
+        uint32_t funct3 = inst.get_funct3();
+        uint32_t rs1 = inst.get_rs1();
+        log_debug_hex("rd", rd);
+        log_debug_hex("funct3", funct3);
+        log_debug_hex("rs1", rs1);
+        if (rs1 != 0x0) {
+          log_error("[R1] Cannot decode instruction: 0x", inst.get_value());
+          exit(1);
+        }
+        if (rd == 0x0) {
+          uint32_t imm = inst.get_imm11_0();
+          log_debug_hex("imm", imm);
+          switch(imm){
+            case IMM_SCALL: {
+              log_info("SCALL");
+              // NOTE: serviced by whoever drives run_slice(), see service_syscall().
+              _syscall.number = _regs[17];
+              _syscall.args[0] = _regs[10];
+              _syscall.args[1] = _regs[11];
+              _syscall.args[2] = _regs[12];
+              _syscall_pending = true;
+              break;
+            }
+            case IMM_SBREAK: {
+              log_info("SBREAK");
+              throw std::runtime_error("Insctruion not implemented yet.");
+              break;
+            }
+            case IMM_SRDCYCLE: {
+              log_info("SRDCYCLE");
+              throw std::runtime_error("Insctruion not implemented yet.");
+              break;
+            }
+            case IMM_SRDCYCLEH: {
+              log_info("SRDCYCLEH");
+              throw std::runtime_error("Insctruion not implemented yet.");
+              break;
+            }
+            case IMM_RDTIME: {
+              log_info("RDTIME");
+              throw std::runtime_error("Insctruion not implemented yet.");
+              break;
+            }
+            case IMM_RDTIMEH: {
+              log_info("RDTIMEH");
+              throw std::runtime_error("Insctruion not implemented yet.");
+              break;
+            }
+            case IMM_RDINSTRET: {
+              log_info("RDINSTRET");
+              throw std::runtime_error("Insctruion not implemented yet.");
+              break;
+            }
+            case IMM_RDINSTRETH: {
+              log_info("RDINSTRETH");
+              throw std::runtime_error("Insctruion not implemented yet.");
+              break;
+            }
+            default: {
+              log_error("[R2] Cannot decode instruction", inst.get_value());
+              exit(1);
+            }
+          }
+        }
+        break;
+      }
+      default: {
+        if (inst.get_value() != 0) {
+          log_error("Cannot decode instruction", inst.get_value());
+          exit(1);
+        }
+      }
+    }
+  }
+
+public:
+  RV32I() : _test([this](uint32_t code) { halt(code); }), _clint(&_instret) {
+    _bus.map(CLINT_BASE, CLINT_WORDS, &_clint);
+    _bus.map(UART_BASE, UART_SCR + 1, &_uart);
+    _bus.map(TEST_BASE, 1, &_test);
+  }
+
+  ~RV32I() {
+    for (CodeEntry *entry : _code) {
+      if (entry) CodeCache::instance().release(entry);
+    }
+  }
+
+  void load_to_ram(std::vector<uint32_t> data) {
+    _ram.load(data);
+  }
+
+  // Runs at most budget instructions. Stops early when the guest halts,
+  // runs out of instructions or issues an ECALL; in the last case the
+  // syscall must be completed with complete_syscall() before running again.
+  SliceResult run_slice(uint32_t budget) {
+    uint32_t n = 0;
+    while (n < budget) {
+      if (_halted || _instret >= MAX_INSTRUCTIONS) {
+        return SLICE_HALTED;
+      }
+      uint32_t pc = _regs.get_pc();
+      const DecodedPage &page = fetch_page(pc);
+      uint32_t offset = pc & (PAGE_WORDS - 1);
+      uint32_t count = std::min({page.block_end(offset) - offset + 1, budget - n,
+                                 MAX_INSTRUCTIONS - _instret});
+      if (const Idiom *idiom = page.idiom(offset)) {
+        uint32_t retired = run_idiom(*idiom, std::min(budget - n, MAX_INSTRUCTIONS - _instret));
+        if (retired) {
+          n += retired;
+          continue;
+        }
+      }
+      _leave_block = false;
+      for (uint32_t i = offset; i < offset + count; i++) {
+        _instret++;
+        n++;
+        // NOTE: a copy, a store may replace the page it came from.
+        Instruction inst = page.get(i);
+        _regs.increment_pc();
+        uint64_t sample = stats_sample_begin();
+        execute(inst);
+        stats_sample_end(inst.get_opcode(), sample);
+        stats_poll();
+#ifdef REGDUMP
+        if (inst.get_value() != 0x0) _regs.dump_regs();
+#endif
+        if (_syscall_pending) {
+          return SLICE_SYSCALL;
+        }
+        if (_leave_block) {
+          break;
+        }
+      }
+    }
+    return SLICE_EXPIRED;
+  }
+
+  void run() {
+    while (run_slice(MAX_INSTRUCTIONS) != SLICE_HALTED) {
+      if (_syscall_pending) {
+        service_syscall();
+      }
+    }
+    _uart.flush();
+  }
+
+  Uart& get_uart() {
+    return _uart;
+  }
+
+  const Syscall& get_syscall() const {
+    return _syscall;
+  }
+
+  void complete_syscall(uint32_t result) {
+    _regs[10] = result;
+    _syscall_pending = false;
+  }
+
+  void halt(uint32_t code) {
+    _exit_code = code;
+    _halted = true;
+    _syscall_pending = false;
+    _leave_block = true;
+  }
+
+  uint32_t get_exit_code() const {
+    return _exit_code;
+  }
+
+  uint32_t get_instret() const {
+    return _instret;
+  }
+
+  void set_reg(uint8_t index, uint32_t val) {
+    _regs[index] = val;
+  }
+
+#ifdef FUZZ
+  // Everything restore() returns to, RAM and devices keep their own copy.
+  struct Snapshot {
+    Registers regs;
+    uint32_t instret;
+  };
+
+  Snapshot snapshot() {
+    _ram.snapshot();
+    _bus.snapshot();
+    return Snapshot{_regs, _instret};
+  }
+
+  void restore(const Snapshot &snap) {
+    // Decoded pages are patched back word by word, like guest stores.
+    for (uint32_t page : _ram.get_dirty_pages()) {
+      if (!_code[page]) continue;
+      for (uint32_t i = 0; i < PAGE_WORDS; i++) {
+        uint32_t addr = (page << PAGE_SHIFT) + i;
+        uint32_t val = _ram.read_snapshot(addr);
+        if (_code[page]->page.get(i).get_value() != val) {
+          patch_code(addr, val);
+        }
+      }
+    }
+    _ram.restore();
+    _bus.restore();
+    _regs = snap.regs;
+    _instret = snap.instret;
+    _halted = false;
+    _exit_code = 0;
+    _syscall_pending = false;
+  }
+#endif
+
+  // Guest buffers hold one byte per word since RAM is word addressed.
+  std::string read_buffer(uint32_t addr, uint32_t len) const {
+    std::string data(len, '\0');
+    for (uint32_t i = 0; i < len; i++) {
+      data[i] = (char)(_ram.read(addr + i) & 0xFF);
+    }
+    return data;
+  }
+
+  void write_buffer(uint32_t addr, const std::string &data) {
+    for (uint32_t i = 0; i < data.size(); i++) {
+      store(addr + i, (uint8_t)data[i]);
+    }
+  }
+
+  // Blocking implementation of the pending syscall on the calling thread.
+  void service_syscall() {
+    const Syscall &sc = _syscall;
+    switch(sc.number) {
+      case SYS_READ: {
+        std::string data(sc.args[2], '\0');
+        ssize_t n = ::read(sc.args[0], data.data(), data.size());
+        if (n > 0) write_buffer(sc.args[1], data.substr(0, n));
+        complete_syscall((uint32_t)(n < 0 ? -errno : n));
+        break;
+      }
+      case SYS_WRITE: {
+        // UART output first so that both kinds of output stay in order.
+        _uart.flush();
+        std::string data = read_buffer(sc.args[1], sc.args[2]);
+        ssize_t n = ::write(sc.args[0], data.data(), data.size());
+        complete_syscall((uint32_t)(n < 0 ? -errno : n));
+        break;
+      }
+      case SYS_NANOSLEEP: {
+        std::this_thread::sleep_for(get_sleep_duration());
+        complete_syscall(0);
+        break;
+      }
+      case SYS_EXIT:
+      case SYS_EXIT_GROUP: {
+        halt(sc.args[0]);
+        break;
+      }
+      default: {
+        log_error("[ECALL] Unsupported syscall", sc.number);
+        complete_syscall((uint32_t)-ENOSYS);
+      }
+    }
+  }
+
+  // nanosleep(req): req points at { seconds, nanoseconds }.
+  std::chrono::nanoseconds get_sleep_duration() const {
+    uint32_t addr = _syscall.args[0];
+    return std::chrono::seconds(_ram.read(addr)) + std::chrono::nanoseconds(_ram.read(addr + 1));
+  }
+};
+
+#ifdef LOCKSTEP
+// Lockstep engine: runs LANES copies of the same image side by side, one per
+// SIMD lane. Registers and memory are stored structure-of-arrays so that an
+// instruction executed by every lane is one vector operation. The integer
+// instructions follow RV32I::execute exactly, so every lane ends in the state
+// a scalar RV32I would reach after the same number of instructions. Of the
+// system side only FENCE.I and the exit syscalls are supported; other
+// syscalls, FENCE and addresses outside lockstep RAM (there are no devices)
+// stop the emulator with an error.
+#if defined(__AVX512F__)
+constexpr int LANES = 16;
+#else
+constexpr int LANES = 8;
+#endif
+// Smaller than Ram: every word is stored LANES times.
+constexpr uint32_t LOCKSTEP_RAM_WORDS = 1024 * 1024;
+typedef uint32_t lanes_u32 __attribute__((vector_size(LANES * sizeof(uint32_t))));
+typedef int32_t lanes_i32 __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+class RV32ILockstep {
+private:
+  // A group of lanes waiting to execute from pc. Lanes are a bit set.
+  struct Frame {
+    uint32_t pc;
+    uint32_t lanes;
+  };
+
+  lanes_u32 _regs[32] = {};
+  lanes_u32 _instret = {};
+  lanes_u32 _lane_bit = {};
+  lanes_u32 _lane_index = {};
+  std::vector<lanes_u32> _mem;
+  // Current group: pc shared by all lanes in _lanes, _mask is the same set
+  // as a vector (-1 for active lanes).
+  uint32_t _pc = 0;
+  uint32_t _lanes = 0;
+  lanes_i32 _mask = {};
+  // Groups that diverged from the current one, sorted by descending pc so
+  // the lowest pc is at the back. Running the lowest pc first makes forward
+  // branches and loop exits re-converge where the paths meet again.
+  std::vector<Frame> _stack;
+
+  static uint32_t lane_bits(lanes_i32 m) {
+    uint32_t bits = 0;
+    for (int l = 0; l < LANES; l++) {
+      bits |= (m[l] != 0) << l;
+    }
+    return bits;
+  }
+
+  void set_group(uint32_t pc, uint32_t lanes) {
+    this->_pc = pc;
+    this->_lanes = lanes;
+    this->_mask = (lanes_i32)((this->_lane_bit & lanes) != 0);
+  }
+
+  void push_frame(uint32_t pc, uint32_t lanes) {
+    auto it = this->_stack.begin();
+    while (it != this->_stack.end() && it->pc > pc) it++;
+    if (it != this->_stack.end() && it->pc == pc) {
+      it->lanes |= lanes;
+      return;
+    }
+    this->_stack.insert(it, Frame{pc, lanes});
+  }
+
+  bool pop_frame() {
+    if (this->_stack.empty()) {
+      return false;
+    }
+    Frame f = this->_stack.back();
+    this->_stack.pop_back();
+    set_group(f.pc, f.lanes);
+    return true;
+  }
+
+  // Continue the current group at pc, merging with any group already
+  // waiting there.
+  void converge(uint32_t pc) {
+    if (this->_stack.empty() || this->_stack.back().pc > pc) {
+      this->_pc = pc;
+      return;
+    }
+    push_frame(pc, this->_lanes);
+    pop_frame();
+  }
+
+  void diverge(uint32_t pc_a, uint32_t lanes_a, uint32_t pc_b, uint32_t lanes_b) {
+    push_frame(pc_a, lanes_a);
+    push_frame(pc_b, lanes_b);
+    pop_frame();
+  }
+
+  void write_rd(uint32_t rd, lanes_u32 val) {
+    this->_regs[rd] = this->_mask ? val : this->_regs[rd];
+  }
+
+  void check_addr(lanes_u32 addr, const char *err) const {
+    uint32_t bad = lane_bits((lanes_i32)(addr >= LOCKSTEP_RAM_WORDS) & this->_mask);
+    if (bad) {
+      log_error(err, addr[__builtin_ctz(bad)]);
+      exit(1);
+    }
+  }
+
+  lanes_u32 load(lanes_u32 addr) const {
+    check_addr(addr, "[READ] Invalid address");
+    uint32_t first = __builtin_ctz(this->_lanes);
+    if (lane_bits((lanes_i32)(addr == addr[first]) & this->_mask) == this->_lanes) {
+      return this->_mem[addr[first]];
+    }
+    lanes_u32 idx = addr * LANES + this->_lane_index;
+    const uint32_t *base = (const uint32_t*)this->_mem.data();
+#if defined(__AVX512F__)
+    return (lanes_u32)_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), (__mmask16)this->_lanes,
+                                                   (__m512i)idx, base, 4);
+#elif defined(__AVX2__)
+    return (lanes_u32)_mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)base,
+                                                   (__m256i)idx, (__m256i)this->_mask, 4);
+#else
+    lanes_u32 val = {};
+    for (int l = 0; l < LANES; l++) {
+      if (this->_lanes & (1 << l)) val[l] = base[idx[l]];
+    }
+    return val;
+#endif
+  }
+
+  void store(lanes_u32 addr, lanes_u32 val) {
+    check_addr(addr, "[WRITE] Invalid address");
+    uint32_t first = __builtin_ctz(this->_lanes);
+    if (lane_bits((lanes_i32)(addr == addr[first]) & this->_mask) == this->_lanes) {
+      lanes_u32 &word = this->_mem[addr[first]];
+      word = this->_mask ? val : word;
+      return;
+    }
+    lanes_u32 idx = addr * LANES + this->_lane_index;
+    uint32_t *base = (uint32_t*)this->_mem.data();
+#if defined(__AVX512F__)
+    _mm512_mask_i32scatter_epi32(base, (__mmask16)this->_lanes, (__m512i)idx, (__m512i)val, 4);
+#else
+    for (int l = 0; l < LANES; l++) {
+      if (this->_lanes & (1 << l)) base[idx[l]] = val[l];
+    }
+#endif
+  }
+
+  // Mirrors Registers::increment_pc_by_offset.
+  static uint32_t branch_target(uint32_t pc, uint32_t offset) {
+    return pc + pc + offset;
+  }
+
+  void branch(Instruction &inst, lanes_i32 cond, uint32_t next) {
+    uint32_t target = branch_target(next, sext(inst.get_imm_branch(), 12));
+    uint32_t taken = lane_bits(cond) & this->_lanes;
+    if (taken == this->_lanes) {
+      converge(target);
+    } else if (taken == 0) {
+      converge(next);
+    } else {
+      diverge(target, taken, next, this->_lanes & ~taken);
+    }
+  }
+
+  // Only exit and exit_group are serviced: the lanes that make them stop
+  // with their exit code in a0, like RV32I::halt. Any other syscall needs a
+  // host to wait on and is an error.
+  void ecall() {
+    lanes_u32 number = this->_regs[17];
+    uint32_t exits = lane_bits((lanes_i32)((number == (uint32_t)SYS_EXIT) | (number == (uint32_t)SYS_EXIT_GROUP)));
+    uint32_t other = this->_lanes & ~exits;
+    if (other) {
+      log_error("[ECALL] Syscall not supported in lockstep", number[__builtin_ctz(other)]);
+      exit(1);
+    }
+    set_group(this->_pc, 0);
+  }
+
+  // Lanes have their own memory, so lanes that stored different code at pc
+  // fetch different instructions. The current group keeps the lanes that
+  // share the first lane's word, the others wait at the same pc.
+  void split_by_code() {
+    if (this->_pc >= LOCKSTEP_RAM_WORDS) {
+      log_error("[FETCH] Invalid address", this->_pc);
+      exit(1);
+    }
+    lanes_u32 words = this->_mem[this->_pc];
+    uint32_t same = lane_bits((lanes_i32)(words == words[__builtin_ctz(this->_lanes)])) & this->_lanes;
+    if (same != this->_lanes) {
+      push_frame(this->_pc, this->_lanes & ~same);
+      set_group(this->_pc, same);
+    }
+  }
+
+  // Executes one instruction for every lane in the current group and moves
+  // the group (or the groups it splits into) to the next pc. The group has
+  // been through split_by_code().
+  void step() {
+    Instruction inst(this->_mem[this->_pc][__builtin_ctz(this->_lanes)]);
+    uint32_t next = this->_pc + 1;
+    uint32_t opcode = inst.get_opcode();
+    uint32_t rd = inst.get_rd();
+    uint32_t funct3 = inst.get_funct3();
+    uint32_t rs1 = inst.get_rs1();
+    uint32_t rs2 = inst.get_rs2();
+    uint32_t funct7 = inst.get_funct7();
+    stats_count(opcode, funct3, __builtin_popcount(this->_lanes));
+    lanes_u32 a = this->_regs[rs1];
+    lanes_u32 b = this->_regs[rs2];
+    switch(opcode) {
+      case OPCODE_LUI: {
+        lanes_u32 val = {};
+        write_rd(rd, val + (uint32_t)sext(inst.get_imm31_12(), 20));
+        break;
+      }
+      case OPCODE_AUIPC: {
+        lanes_u32 val = {};
+        write_rd(rd, val + (uint32_t)sext(inst.get_imm31_12(), 20) + next);
+        break;
+      }
+      case OPCODE_JAL: {
+        lanes_u32 val = {};
+        write_rd(rd, val + next + 1);
+        converge(branch_target(next, sext(inst.get_imm31_12(), 20)));
+        return;
+      }
+      case OPCODE_JALR: {
+        lanes_u32 jaddr = (a + (uint32_t)sext(inst.get_imm11_0(), 12)) & ~1u;
+        lanes_u32 val = {};
+        write_rd(rd, val + next + 1);
+        uint32_t first = __builtin_ctz(this->_lanes);
+        uint32_t same = lane_bits((lanes_i32)(jaddr == jaddr[first])) & this->_lanes;
+        if (same == this->_lanes) {
+          converge(jaddr[first]);
+          return;
+        }
+        uint32_t rest = this->_lanes;
+        while (rest) {
+          uint32_t target = jaddr[__builtin_ctz(rest)];
+          uint32_t group = lane_bits((lanes_i32)(jaddr == target)) & rest;
+          push_frame(target, group);
+          rest &= ~group;
+        }
+        pop_frame();
+        return;
+      }
+      case OPCODE_BRANCH: {
+        switch(funct3) {
+          case FUNCT3_BEQ: branch(inst, (lanes_i32)(a == b), next); return;
+          case FUNCT3_BNE: branch(inst, (lanes_i32)(a != b), next); return;
+          case FUNCT3_BLT: branch(inst, (lanes_i32)a < (lanes_i32)b, next); return;
+          case FUNCT3_BGE: branch(inst, (lanes_i32)a >= (lanes_i32)b, next); return;
+          case FUNCT3_BLTU: branch(inst, (lanes_i32)(a < b), next); return;
+          case FUNCT3_BGEU: branch(inst, (lanes_i32)(a >= b), next); return;
+          default: {
+            log_error("[BRANCH] Cannot decode instruction: 0x", inst.get_value());
+            exit(1);
+          }
+        }
+      }
+      case OPCODE_LOAD: {
+        lanes_u32 val = load(a + (uint32_t)sext(inst.get_imm11_0(), 12));
+        switch(funct3) {
+          case FUNCT3_LOAD_BYTE:
+          case FUNCT3_LOAD_BYTE_U: write_rd(rd, val & 0x000000FF); break;
+          case FUNCT3_LOAD_HALF:
+          case FUNCT3_LOAD_HALF_U: write_rd(rd, val & 0x0000FFFF); break;
+          case FUNCT3_LOAD_WORD: write_rd(rd, val); break;
+          default: {
+            log_error("[LOAD]Cannot decode instruction: 0x", inst.get_value());
+            exit(1);
+          }
+        }
+        break;
+      }
+      case OPCODE_STORE: {
+        lanes_u32 addr = a + (uint32_t)sext(inst.get_imm_store(), 12);
+        switch(funct3) {
+          case FUNCT3_STORE_BYTE: store(addr, b & 0b00000000000000000000000001111111); break;
+          case FUNCT3_STORE_HALF: store(addr, b & 0b00000000000000001111111111111111); break;
+          case FUNCT3_STORE_WORD: store(addr, b); break;
+          default: {
+            log_error("[STORE] Cannot decode instruction: 0x", inst.get_value());
             exit(1);
           }
         }
         break;
       }
-      case OPCODE_R: {
-        log_info("opcode R");
-        uint32_t rd = inst.get_rd();
-        uint32_t funct3 = inst.get_funct3();
-        uint32_t rs1 = inst.get_rs1();
-        log_debug_hex("rd", rd);
-        log_debug_hex("funct3", funct3);
-        log_debug_hex("rs1", rs1);
-        if (rs1 != 0x0) {
-          log_error("[R1] Cannot decode instruction: 0x", inst.get_value());
-          exit(1);
-        }
-        if (rd == 0x0) {
-          uint32_t imm = inst.get_imm11_0();
-          log_debug_hex("imm", imm);
-          switch(imm){
-            case IMM_SCALL: {
-              log_info("SCALL");
-              throw std::runtime_error("Insctruion not implemented yet.");
-              break;
-            }
-            case IMM_SBREAK: {
-              log_info("SBREAK");
-              throw std::runtime_error("Insctruion not implemented yet.");
-              break;
-            }
-            case IMM_SRDCYCLE: {
-              log_info("SRDCYCLE");
-              throw std::runtime_error("Insctruion not implemented yet.");
-              break;
-            }
-            case IMM_SRDCYCLEH: {
-              log_info("SRDCYCLEH");
-              throw std::runtime_error("Insctruion not implemented yet.");
-              break;
-            }
-            case IMM_RDTIME: {
-              log_info("RDTIME");
-              throw std::runtime_error("Insctruion not implemented yet.");
-              break;
-            }
-            case IMM_RDTIMEH: {
-              log_info("RDTIMEH");
-              throw std::runtime_error("Insctruion not implemented yet.");
-              break;
-            }
-            case IMM_RDINSTRET: {
-              log_info("RDINSTRET");
-              throw std::runtime_error("Insctruion not implemented yet.");
-              break;
+      case OPCODE_INT_COMP_I: {
+        uint32_t imm = (uint32_t)sext(inst.get_imm11_0(), 12);
+        uint32_t shamt = rs2;
+        switch(funct3) {
+          case FUNCT3_ADDI: write_rd(rd, a + imm); break;
+          case FUNCT3_SLTI: write_rd(rd, (lanes_u32)((lanes_i32)a < (int32_t)imm) & 1); break;
+          case FUNCT3_SLTIU: write_rd(rd, (lanes_u32)(a < imm) & 1); break;
+          case FUNCT3_XORI: write_rd(rd, a ^ imm); break;
+          case FUNCT3_ORI: write_rd(rd, a | imm); break;
+          case FUNCT3_ANDI: write_rd(rd, a & imm); break;
+          case FUNCT3_SLLI: write_rd(rd, a << shamt); break;
+          case FUNCT3_SRAI: {
+            if (funct7 != 0x0 && funct7 != 0x20000000) {
+              log_error("[SRAI] Cannot decode instruction: 0x", inst.get_value());
+              exit(1);
             }
-            case IMM_RDINSTRETH: {
-              log_info("RDINSTRETH");
-              throw std::runtime_error("Insctruion not implemented yet.");
-              break;
+            // NOTE: logical for both, same as RV32I::execute.
+            write_rd(rd, a >> shamt);
+            break;
+          }
+        }
+        break;
+      }
+      case OPCODE_INT_COMP_R: {
+        // NOTE: shift amounts are masked like the x86 scalar shifts RV32I uses.
+        lanes_u32 shamt = b & 31;
+        if (funct7 == 0x0) {
+          switch(funct3) {
+            case FUNCT3_ADD: write_rd(rd, a + b); break;
+            case FUNCT3_SLL: write_rd(rd, a << shamt); break;
+            case FUNCT3_SLT: write_rd(rd, (lanes_u32)((lanes_i32)a < (lanes_i32)b) & 1); break;
+            case FUNCT3_SLTU: write_rd(rd, (lanes_u32)(a < b) & 1); break;
+            case FUNCT3_XOR: write_rd(rd, a ^ b); break;
+            case FUNCT3_SRL: write_rd(rd, a >> shamt); break;
+            case FUNCT3_OR: write_rd(rd, a | b); break;
+            case FUNCT3_AND: write_rd(rd, a & b); break;
+            default: {
+              log_error("[COMP_R1] Cannot decode instruction: 0x", inst.get_value());
+              exit(1);
             }
+          }
+        } else if (funct7 == 0x40000000) {
+          switch(funct3) {
+            case FUNCT3_SUB: write_rd(rd, a - b); break;
+            case FUNCT3_SRA: write_rd(rd, a >> shamt); break;
             default: {
-              log_error("[R2] Cannot decode instruction", inst.get_value());
+              log_error("[COMP_R2] Cannot decode instruction: 0x", inst.get_value());
               exit(1);
             }
           }
+        } else {
+          log_error("[COMP_R] Cannot decode instruction: 0x", inst.get_value());
+          exit(1);
         }
         break;
       }
+      case OPCODE_FENCE: {
+        // NOTE: no decoded code to keep in sync, FENCE.I does nothing here.
+        if (funct3 == FUNCT3_FENCEI && rs1 == 0 && inst.get_imm11_0() == 0) {
+          break;
+        }
+        log_error("[FENCE] Not supported in lockstep: 0x", inst.get_value());
+        exit(1);
+      }
+      case OPCODE_R: {
+        if (rd == 0 && rs1 == 0 && inst.get_imm11_0() == IMM_SCALL) {
+          ecall();
+          return;
+        }
+        log_error("[R] Not supported in lockstep: 0x", inst.get_value());
+        exit(1);
+      }
       default: {
         if (inst.get_value() != 0) {
           log_error("Cannot decode instruction", inst.get_value());
@@ -755,40 +2698,446 @@ private:
         }
       }
     }
+    converge(next);
   }
 
 public:
-  RV32I() { }
+  RV32ILockstep() : _mem(LOCKSTEP_RAM_WORDS) {
+    for (int l = 0; l < LANES; l++) {
+      this->_lane_bit[l] = 1u << l;
+      this->_lane_index[l] = l;
+    }
+  }
 
   void load_to_ram(std::vector<uint32_t> data) {
-    _ram.load(data);
+    if (data.size() > LOCKSTEP_RAM_WORDS) {
+      log_error("[LOAD] Image does not fit lockstep RAM, words", data.size());
+      exit(1);
+    }
+    for (uint32_t i = 0; i < data.size(); i++) {
+      lanes_u32 word = {};
+      this->_mem[i] = word + data.at(i);
+    }
   }
 
-  void run() {
-    int i = 0;
-    while (i++ < 100000) {
-      Instruction* inst = instruction_fetch();
-      execute(*inst);
-#ifdef REGDUMP
-      if (inst->get_value() == 0x0) continue;
-      _regs.dump_regs();
+  // Lanes are started with x10 (a0) set to their input. Only the first
+  // inputs.size() lanes run.
+  void run(const std::vector<uint32_t> &inputs) {
+    uint32_t lanes = 0;
+    for (uint32_t l = 0; l < inputs.size() && l < LANES; l++) {
+      this->_regs[10][l] = inputs[l];
+      lanes |= 1u << l;
+    }
+    this->_stack.clear();
+    set_group(0, lanes);
+    while (this->_lanes) {
+      split_by_code();
+      lanes_u32 before = this->_instret;
+      uint32_t lanes = this->_lanes;
+      lanes_i32 mask = this->_mask;
+      step();
+      stats_poll();
+      this->_instret = before + ((lanes_u32)mask & 1);
+      // Lanes that used up their budget leave whatever group they are in.
+      uint32_t done = lane_bits((lanes_i32)(this->_instret >= MAX_INSTRUCTIONS)) & lanes;
+      if (done) {
+        for (Frame &f : this->_stack) f.lanes &= ~done;
+        std::erase_if(this->_stack, [](const Frame &f) { return f.lanes == 0; });
+        set_group(this->_pc, this->_lanes & ~done);
+      }
+      if (this->_lanes == 0) {
+        pop_frame();
+      }
+    }
+  }
+
+  uint32_t get_reg(int lane, uint8_t index) const {
+    return this->_regs[index][lane];
+  }
+
+  void dump_regs(int lane) const {
+    std::cout << "\tDumping regs of lane " << std::dec << lane << "...\n";
+    for(int i = 0; i < 32; i++) {
+      std::cout << "\tx-" << std::dec << i << ": 0x" << std::hex << this->_regs[i][lane] << '\n';
+    }
+    std::cout << "\tDone" << std::endl;
+  }
+};
 #endif
+
+#ifdef SCHED
+// Cooperative scheduler: every guest is a coroutine that gives up its host
+// thread when its time slice ends or when it waits for I/O or a timer, so a
+// few worker threads can multiplex thousands of mostly idle guests.
+constexpr uint32_t SCHED_SLICE = 10000;
+
+class Scheduler;
+
+struct GuestTask {
+  struct promise_type {
+    GuestTask get_return_object() {
+      return GuestTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    // Started by Scheduler::spawn, frame freed as soon as the guest returns.
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() { }
+    void unhandled_exception() { std::terminate(); }
+  };
+  std::coroutine_handle<promise_type> handle;
+};
+
+class Scheduler {
+private:
+  struct Timer {
+    std::chrono::steady_clock::time_point deadline;
+    std::coroutine_handle<> handle;
+    bool operator>(const Timer &other) const {
+      return this->deadline > other.deadline;
+    }
+  };
+
+  struct IoRequest {
+    uint32_t number;
+    int fd;
+    std::string data;
+    uint32_t len;
+    ssize_t result;
+    std::coroutine_handle<> handle;
+    // Bytes of data already written.
+    size_t done = 0;
+  };
+
+  std::mutex _mutex;
+  std::condition_variable _ready_cv;
+  std::deque<std::coroutine_handle<>> _ready;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> _timers;
+  std::mutex _io_mutex;
+  std::deque<IoRequest*> _io;
+  // Wakes io_loop() when a request is submitted or the scheduler stops.
+  int _io_wake[2] = {-1, -1};
+  // Flags of every guest fd before it was made non-blocking.
+  std::unordered_map<int, int> _fd_flags;
+  size_t _live = 0;
+  bool _stopping = false;
+
+  void make_ready(std::coroutine_handle<> h) {
+    {
+      std::lock_guard<std::mutex> lock(this->_mutex);
+      this->_ready.push_back(h);
+    }
+    this->_ready_cv.notify_one();
+  }
+
+  void worker() {
+    std::unique_lock<std::mutex> lock(this->_mutex);
+    while (true) {
+      auto now = std::chrono::steady_clock::now();
+      while (!this->_timers.empty() && this->_timers.top().deadline <= now) {
+        this->_ready.push_back(this->_timers.top().handle);
+        this->_timers.pop();
+      }
+      if (!this->_ready.empty()) {
+        std::coroutine_handle<> h = this->_ready.front();
+        this->_ready.pop_front();
+        lock.unlock();
+        h.resume();
+        lock.lock();
+        continue;
+      }
+      if (this->_live == 0) {
+        break;
+      }
+      if (this->_timers.empty()) {
+        this->_ready_cv.wait(lock);
+      } else {
+        this->_ready_cv.wait_until(lock, this->_timers.top().deadline);
+      }
+    }
+    this->_ready_cv.notify_all();
+  }
+
+  // Guest fds are switched to non-blocking the first time they are used, so
+  // a read that has nothing to return never holds up anything else.
+  void make_nonblocking(int fd) {
+    std::lock_guard<std::mutex> lock(this->_io_mutex);
+    if (this->_fd_flags.count(fd)) {
+      return;
+    }
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags < 0) {
+      // Not an open fd; the request itself fails with EBADF.
+      return;
+    }
+    this->_fd_flags[fd] = flags;
+    ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  // Makes as much progress on req as possible without blocking. Returns
+  // true once it is complete and req->result is set.
+  static bool try_io(IoRequest *req) {
+    while (true) {
+      ssize_t n;
+      if (req->number == SYS_READ) {
+        req->data.resize(req->len);
+        n = ::read(req->fd, req->data.data(), req->len);
+        if (n >= 0) {
+          req->result = n;
+          return true;
+        }
+      } else {
+        if (req->done == req->data.size()) {
+          req->result = req->done;
+          return true;
+        }
+        n = ::write(req->fd, req->data.data() + req->done, req->data.size() - req->done);
+        if (n >= 0) {
+          req->done += n;
+          continue;
+        }
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return false;
+      }
+      // A write that already made progress reports what it wrote.
+      req->result = req->done > 0 ? (ssize_t)req->done : -errno;
+      return true;
+    }
+  }
+
+  // The only thread that waits on host fds: one poll() over every request
+  // that could not complete right away, resuming each guest as its fd
+  // becomes ready. Reads waiting for input never hold up writes.
+  void io_loop() {
+    std::vector<IoRequest*> pending;
+    std::vector<pollfd> fds;
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(this->_io_mutex);
+        pending.insert(pending.end(), this->_io.begin(), this->_io.end());
+        this->_io.clear();
+        if (this->_stopping && pending.empty()) {
+          break;
+        }
+      }
+      fds.clear();
+      fds.push_back(pollfd{this->_io_wake[0], POLLIN, 0});
+      for (IoRequest *req : pending) {
+        fds.push_back(pollfd{req->fd, (short)(req->number == SYS_READ ? POLLIN : POLLOUT), 0});
+      }
+      if (::poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+        log_error("[IO] poll failed, errno", errno);
+        exit(1);
+      }
+      if (fds[0].revents) {
+        char buf[64];
+        while (::read(this->_io_wake[0], buf, sizeof(buf)) > 0) { }
+      }
+      size_t kept = 0;
+      for (size_t i = 0; i < pending.size(); i++) {
+        IoRequest *req = pending[i];
+        if (fds[i + 1].revents && try_io(req)) {
+          make_ready(req->handle);
+        } else {
+          pending[kept++] = req;
+        }
+      }
+      pending.resize(kept);
+    }
+  }
+
+  void wake_io() {
+    char c = 0;
+    ssize_t n = ::write(this->_io_wake[1], &c, 1);
+    (void)n;
+  }
+
+  void submit_io(IoRequest *req) {
+    {
+      std::lock_guard<std::mutex> lock(this->_io_mutex);
+      this->_io.push_back(req);
+    }
+    wake_io();
+  }
+
+  void add_timer(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> h) {
+    {
+      std::lock_guard<std::mutex> lock(this->_mutex);
+      this->_timers.push(Timer{deadline, h});
+    }
+    this->_ready_cv.notify_one();
+  }
+
+public:
+  Scheduler() {
+    if (::pipe(this->_io_wake) < 0) {
+      log_error("[IO] Can't create wake pipe, errno", errno);
+      exit(1);
+    }
+    for (int fd : this->_io_wake) {
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+  }
+
+  ~Scheduler() {
+    ::close(this->_io_wake[0]);
+    ::close(this->_io_wake[1]);
+  }
+
+  struct YieldAwaiter {
+    Scheduler &sched;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { sched.make_ready(h); }
+    void await_resume() const noexcept { }
+  };
+
+  struct SleepAwaiter {
+    Scheduler &sched;
+    std::chrono::nanoseconds duration;
+    bool await_ready() const noexcept { return duration.count() <= 0; }
+    void await_suspend(std::coroutine_handle<> h) {
+      sched.add_timer(std::chrono::steady_clock::now() + duration, h);
+    }
+    void await_resume() const noexcept { }
+  };
+
+  // The request lives in the suspended coroutine frame until completion and
+  // is moved out on resume: the awaiter is a temporary that dies with the
+  // co_await expression.
+  struct IoAwaiter {
+    Scheduler &sched;
+    IoRequest req;
+    bool await_ready() const noexcept { return false; }
+    // Requests that complete without blocking resume the guest right away.
+    bool await_suspend(std::coroutine_handle<> h) {
+      sched.make_nonblocking(req.fd);
+      if (try_io(&req)) {
+        return false;
+      }
+      req.handle = h;
+      sched.submit_io(&req);
+      return true;
+    }
+    IoRequest await_resume() noexcept { return std::move(req); }
+  };
+
+  YieldAwaiter yield() {
+    return YieldAwaiter{*this};
+  }
+
+  SleepAwaiter sleep(std::chrono::nanoseconds duration) {
+    return SleepAwaiter{*this, duration};
+  }
+
+  IoAwaiter read(int fd, uint32_t len) {
+    return IoAwaiter{*this, IoRequest{SYS_READ, fd, "", len, 0, nullptr}};
+  }
+
+  IoAwaiter write(int fd, std::string data) {
+    return IoAwaiter{*this, IoRequest{SYS_WRITE, fd, std::move(data), 0, 0, nullptr}};
+  }
+
+  void spawn(GuestTask task) {
+    {
+      std::lock_guard<std::mutex> lock(this->_mutex);
+      this->_live++;
+    }
+    make_ready(task.handle);
+  }
+
+  // Called by a guest coroutine right before it returns.
+  void exited() {
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(this->_mutex);
+      last = --this->_live == 0;
+    }
+    if (last) {
+      this->_ready_cv.notify_all();
+    }
+  }
+
+  // Runs until every spawned guest has returned.
+  void run(int threads) {
+    std::thread io(&Scheduler::io_loop, this);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+      workers.emplace_back(&Scheduler::worker, this);
     }
+    for (std::thread &t : workers) {
+      t.join();
+    }
+    {
+      std::lock_guard<std::mutex> lock(this->_io_mutex);
+      this->_stopping = true;
+    }
+    wake_io();
+    io.join();
+    for (auto &[fd, flags] : this->_fd_flags) {
+      ::fcntl(fd, F_SETFL, flags);
+    }
+    this->_fd_flags.clear();
   }
 };
 
+// Same syscalls as RV32I::service_syscall, but waiting suspends the guest
+// instead of blocking the host thread.
+GuestTask run_guest(Scheduler &sched, RV32I &rv) {
+  // UART output goes through the I/O loop too, once per slice, before a
+  // write syscall from the same slice.
+  Uart &uart = rv.get_uart();
+  uart.set_deferred(true);
+  while (true) {
+    SliceResult result = rv.run_slice(SCHED_SLICE);
+    std::string out = uart.take();
+    if (!out.empty() && uart.get_output() >= 0) {
+      co_await sched.write(uart.get_output(), std::move(out));
+    }
+    if (result == SLICE_HALTED) {
+      break;
+    }
+    if (result == SLICE_EXPIRED) {
+      co_await sched.yield();
+      continue;
+    }
+    const Syscall &sc = rv.get_syscall();
+    switch(sc.number) {
+      case SYS_READ: {
+        uint32_t addr = sc.args[1];
+        auto req = co_await sched.read(sc.args[0], sc.args[2]);
+        if (req.result > 0) rv.write_buffer(addr, req.data.substr(0, req.result));
+        rv.complete_syscall((uint32_t)req.result);
+        break;
+      }
+      case SYS_WRITE: {
+        auto req = co_await sched.write(sc.args[0], rv.read_buffer(sc.args[1], sc.args[2]));
+        rv.complete_syscall((uint32_t)req.result);
+        break;
+      }
+      case SYS_NANOSLEEP: {
+        co_await sched.sleep(rv.get_sleep_duration());
+        rv.complete_syscall(0);
+        break;
+      }
+      default: {
+        rv.service_syscall();
+      }
+    }
+  }
+  sched.exited();
+}
+#endif
+
 static uint32_t inline swapEndian(uint32_t value) {
     return ((value >> 24) & 0xFF) | ((value >> 8) & 0xFF00) |
            ((value << 8) & 0xFF0000) | ((value << 24) & 0xFF000000);
 }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    std::cout << "[ERROR] Usage: ./main <filename>" << std::endl;
-    exit(1);
-  }
-  const int ms = 1024 * 1024 * 4;
-  std::ifstream file(argv[1], std::ios::binary);
+std::vector<uint32_t> read_image(const char *filename) {
+  std::ifstream file(filename, std::ios::binary);
 
   file.seekg(0, std::ios::end);
   std::streampos file_size = file.tellg();
@@ -796,8 +3145,8 @@ int main(int argc, char **argv) {
 
   std::size_t elems = file_size / sizeof(uint32_t);
 
-  if (elems > ms ) {
-    std::cout << file_size / sizeof(uint32_t) << " > " << ms << std::endl;
+  if (elems > RAM_WORDS) {
+    std::cout << file_size / sizeof(uint32_t) << " > " << RAM_WORDS << std::endl;
     exit(1);
   }
 
@@ -805,7 +3154,108 @@ int main(int argc, char **argv) {
 
   file.read(reinterpret_cast<char*>(buffer.data()), file_size);
   file.close();
- 
+  return buffer;
+}
+
+#ifdef FUZZ
+// Persistent-mode libFuzzer target. The image named by RV_FUZZ_IMAGE is
+// loaded once and every input starts from a snapshot taken right after
+// loading. The input can be read by the guest from fd 0; if RV_FUZZ_ADDR is
+// set it is also copied to that word address, one byte per word, with
+// a0 = address and a1 = length.
+// RV_FUZZ_BUDGET limits the instructions run per input.
+static RV32I *g_fuzz_rv = nullptr;
+static RV32I::Snapshot g_fuzz_snapshot;
+static bool g_fuzz_inject = false;
+static uint32_t g_fuzz_addr = 0;
+static uint32_t g_fuzz_budget = MAX_INSTRUCTIONS;
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  const char *image = std::getenv("RV_FUZZ_IMAGE");
+  if (image == nullptr) {
+    std::cerr << "[ERROR] RV_FUZZ_IMAGE is not set" << std::endl;
+    exit(1);
+  }
+  if (const char *addr = std::getenv("RV_FUZZ_ADDR")) {
+    g_fuzz_inject = true;
+    g_fuzz_addr = std::stoul(addr, nullptr, 0);
+  }
+  if (const char *budget = std::getenv("RV_FUZZ_BUDGET")) {
+    g_fuzz_budget = std::stoul(budget, nullptr, 0);
+    // run_slice() never runs past MAX_INSTRUCTIONS in total.
+    if (g_fuzz_budget == 0 || g_fuzz_budget > MAX_INSTRUCTIONS) {
+      std::cerr << "[ERROR] RV_FUZZ_BUDGET must be between 1 and " << MAX_INSTRUCTIONS << std::endl;
+      exit(1);
+    }
+  }
+  code_cache_init();
+  g_fuzz_rv = new RV32I();
+  g_fuzz_rv->get_uart().set_output(-1);
+  g_fuzz_rv->load_to_ram(read_image(image));
+  g_fuzz_snapshot = g_fuzz_rv->snapshot();
+  return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  RV32I &rv = *g_fuzz_rv;
+  rv.restore(g_fuzz_snapshot);
+  g_coverage_prev = 0;
+  std::string input(reinterpret_cast<const char*>(data), size);
+  if (g_fuzz_inject) {
+    input.resize(std::min<size_t>(size, RAM_WORDS - std::min(g_fuzz_addr, RAM_WORDS)));
+    rv.write_buffer(g_fuzz_addr, input);
+    rv.set_reg(10, g_fuzz_addr);
+    rv.set_reg(11, input.size());
+  }
+  size_t cursor = 0;
+  uint32_t end = rv.get_instret() + g_fuzz_budget;
+  while (rv.get_instret() < end && rv.run_slice(end - rv.get_instret()) == SLICE_SYSCALL) {
+    const Syscall &sc = rv.get_syscall();
+    switch(sc.number) {
+      case SYS_READ: {
+        uint32_t n = 0;
+        if (sc.args[0] == 0) {
+          n = std::min<size_t>(sc.args[2], input.size() - cursor);
+          rv.write_buffer(sc.args[1], input.substr(cursor, n));
+          cursor += n;
+        }
+        rv.complete_syscall(n);
+        break;
+      }
+      case SYS_WRITE: {
+        rv.complete_syscall(sc.args[2]);
+        break;
+      }
+      case SYS_NANOSLEEP: {
+        rv.complete_syscall(0);
+        break;
+      }
+      case SYS_EXIT:
+      case SYS_EXIT_GROUP: {
+        rv.halt(sc.args[0]);
+        break;
+      }
+      default: {
+        rv.complete_syscall((uint32_t)-ENOSYS);
+      }
+    }
+  }
+  return 0;
+}
+#else
+int main(int argc, char **argv) {
+  if (argc < 2) {
+#if defined(LOCKSTEP)
+    std::cout << "[ERROR] Usage: ./main <filename> [a0 input...]" << std::endl;
+#elif defined(SCHED)
+    std::cout << "[ERROR] Usage: ./main <filename> [guests] [threads]" << std::endl;
+#else
+    std::cout << "[ERROR] Usage: ./main <filename>" << std::endl;
+#endif
+    exit(1);
+  }
+  std::vector<uint32_t> buffer = read_image(argv[1]);
+
   // TODO: optimize this loop. It does run unnesseecrly if debug flag is not set.
   bool is_zero = false;
   int zeros = 0;
@@ -824,9 +3274,58 @@ int main(int argc, char **argv) {
     log_debug_hex("value", v);
   }
 
+  stats_init();
+#ifdef LOCKSTEP
+  // One guest per input, LANES guests per batch.
+  std::vector<uint32_t> inputs;
+  for (int i = 2; i < argc; i++) {
+    inputs.push_back(std::stoul(argv[i], nullptr, 0));
+  }
+  if (inputs.empty()) {
+    inputs.push_back(0);
+  }
+  for (size_t batch = 0; batch < inputs.size(); batch += LANES) {
+    std::vector<uint32_t> lanes(inputs.begin() + batch,
+                                inputs.begin() + std::min(inputs.size(), batch + LANES));
+    auto rv = new RV32ILockstep();
+    rv->load_to_ram(buffer);
+    rv->run(lanes);
+    for (size_t l = 0; l < lanes.size(); l++) {
+      std::cout << "0x" << std::hex << lanes[l] << ": x10 = 0x" << rv->get_reg(l, 10) << std::endl;
+#ifdef REGDUMP
+      rv->dump_regs(l);
+#endif
+    }
+    delete rv;
+  }
+#elif defined(SCHED)
+  code_cache_init();
+  int guests = argc > 2 ? std::stoi(argv[2]) : 1;
+  int threads = argc > 3 ? std::stoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+  Scheduler sched;
+  std::vector<std::unique_ptr<RV32I>> rvs;
+  for (int i = 0; i < guests; i++) {
+    rvs.push_back(std::make_unique<RV32I>());
+    rvs.back()->load_to_ram(buffer);
+    sched.spawn(run_guest(sched, *rvs.back()));
+  }
+  sched.run(threads);
+  // Like the single guest build: the exit code of the first guest that
+  // failed, or 0 when all of them succeeded.
+  for (int i = 0; i < guests; i++) {
+    uint32_t code = rvs[i]->get_exit_code();
+    if (code != 0) {
+      log_error("[EXIT] Non-zero exit code from guest", i);
+      return code;
+    }
+  }
+#else
+  code_cache_init();
   auto rv = new RV32I();
   rv->load_to_ram(buffer);
   rv->run();
+  return rv->get_exit_code();
+#endif
   return 0;
 }
-
+#endif
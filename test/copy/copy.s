@@ -0,0 +1,70 @@
+# Word copy loop in the shape memcpy compiles to, run as one bulk copy.
+#
+# Exits with 0 on success, 1 if memory is wrong and 2 if the
+# instruction count differs from the interpreted loop.
+#
+# Stores use the emulator's store opcode (0x43) and branch offsets follow
+# Registers::increment_pc_by_offset, so both are written out by hand.
+.text
+  .global _start
+
+_start:
+  # src[i] = 1 + i; the stored value changes, so this loop is interpreted
+  addi t0, x0, 1024               # src
+  addi t1, x0, 1088               # end of src
+  addi t2, x0, 1
+  addi x0, x0, 0                  # keeps the next label on an even word
+init:
+  .insn s 0x43, 2, t2, 0(t0)      # sw t2, 0(t0)
+  addi t2, t2, 1
+  addi t0, t0, 1
+  bne t0, t1, . - 12              # -> init
+
+  # copy 64 words from 1024 to 1536
+  addi t0, x0, 1024               # src
+  addi t3, x0, 1536               # dst
+  addi t1, x0, 1088               # end of src
+  addi x0, x0, 0                  # keeps the next label on an even word
+copy:
+  lw t4, 0(t0)
+  .insn s 0x43, 2, t4, 0(t3)      # sw t4, 0(t3)
+  addi t0, t0, 1
+  addi t3, t3, 1
+  bne t0, t1, . - 22              # -> copy
+
+  # dst[i] must be 1 + i and the word after dst untouched
+  addi t0, x0, 1536
+  addi t2, x0, 1
+  addi x0, x0, 0                  # keeps the next label on an even word
+check:
+  lw t4, 0(t0)
+  bne t4, t2, . - 4               # -> fail
+  addi t2, t2, 1
+  addi t0, t0, 1
+  bne t0, t3, . - 30              # -> check
+  lw t4, 0(t3)
+  bne t4, x0, . - 14              # -> fail
+
+  # mtime counts retired instructions; it must match the interpreted count
+  addi t5, x0, 1
+  slli t5, t5, 25                 # CLINT 0x02000000
+  addi t6, x0, 767
+  slli t6, t6, 4
+  addi t6, t6, 14                 # mtime at word 0x2FFE
+  add t5, t5, t6
+  lw a1, 0(t5)
+  addi t6, x0, 916
+  bne a1, t6, . - 28              # -> bad_count
+  addi a0, x0, 0
+  addi a7, x0, 93
+  ecall
+  addi x0, x0, 0                  # keeps the next label on an even word
+fail:
+  addi a0, x0, 1
+  addi a7, x0, 93
+  ecall
+  addi x0, x0, 0                  # keeps the next label on an even word
+bad_count:
+  addi a0, x0, 2
+  addi a7, x0, 93
+  ecall
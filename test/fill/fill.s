@@ -0,0 +1,76 @@
+# Fill loops in the shape memset compiles to, one storing words and one
+# storing bytes every other word, each run as one bulk fill.
+#
+# Exits with 0 on success, 1 if memory is wrong and 2 if the
+# instruction count differs from the interpreted loop.
+#
+# Stores use the emulator's store opcode (0x43) and branch offsets follow
+# Registers::increment_pc_by_offset, so both are written out by hand.
+.text
+  .global _start
+
+_start:
+  # 64 words of 0x55 from 1024
+  addi t0, x0, 1024
+  addi t1, x0, 1088
+  addi t2, x0, 85
+  addi x0, x0, 0                  # keeps the next label on an even word
+fill:
+  .insn s 0x43, 2, t2, 0(t0)      # sw t2, 0(t0)
+  addi t0, t0, 1
+  bne t0, t1, . - 10              # -> fill
+
+  # 64 bytes of 0x7F at every other word from 1536
+  addi t0, x0, 1536
+  addi t1, x0, 1664
+  addi t2, x0, 127
+fill_bytes:
+  .insn s 0x43, 0, t2, 0(t0)      # sb t2, 0(t0)
+  addi t0, t0, 2
+  bne t0, t1, . - 16              # -> fill_bytes
+
+  # check both, including the untouched words in between and after
+  addi t0, x0, 1024
+  addi t1, x0, 1088
+  addi t2, x0, 85
+check:
+  lw t4, 0(t0)
+  bne t4, t2, . + 8               # -> fail
+  addi t0, t0, 1
+  bne t0, t1, . - 24              # -> check
+  lw t4, 0(t1)
+  bne t4, x0, . + 0               # -> fail
+  addi t0, x0, 1536
+  addi t1, x0, 1664
+  addi t2, x0, 127
+  addi x0, x0, 0                  # keeps the next label on an even word
+check_bytes:
+  lw t4, 0(t0)
+  bne t4, t2, . - 12              # -> fail
+  lw t4, 1(t0)
+  bne t4, x0, . - 16              # -> fail
+  addi t0, t0, 2
+  bne t0, t1, . - 38              # -> check_bytes
+
+  # mtime counts retired instructions; it must match the interpreted count
+  addi t5, x0, 1
+  slli t5, t5, 25                 # CLINT 0x02000000
+  addi t6, x0, 767
+  slli t6, t6, 4
+  addi t6, t6, 14                 # mtime at word 0x2FFE
+  add t5, t5, t6
+  lw a1, 0(t5)
+  addi t6, x0, 1047
+  bne a1, t6, . - 34              # -> bad_count
+  addi a0, x0, 0
+  addi a7, x0, 93
+  ecall
+fail:
+  addi a0, x0, 1
+  addi a7, x0, 93
+  ecall
+  addi x0, x0, 0                  # keeps the next label on an even word
+bad_count:
+  addi a0, x0, 2
+  addi a7, x0, 93
+  ecall
@@ -0,0 +1,48 @@
+# Lockstep example where lanes diverge in both code and control flow.
+#
+# Every lane writes `addi a0, a0, n` (n = its input) over `site` and runs it,
+# so each lane executes a different instruction at the same pc. Then it
+# sums 1..a0 in a loop that runs a different number of times per lane and
+# exits with the sum, n * (2n + 1):
+#
+#   ./main test/lockstep/lockstep.bin 0 1 2 3 5 7 10 100
+#   0x0: x10 = 0x0
+#   0x1: x10 = 0x3
+#   0x2: x10 = 0xa
+#   0x3: x10 = 0x15
+#   0x5: x10 = 0x37
+#   0x7: x10 = 0x69
+#   0xa: x10 = 0xd2
+#   0x64: x10 = 0x4e84
+#
+# The scalar build runs it with a0 = 0 and exits with 0.
+#
+# Stores use the emulator's store opcode (0x43) and branch offsets follow
+# Registers::increment_pc_by_offset, so both are written out by hand.
+.text
+  .global _start
+
+_start:
+  # t0 = addi a0, a0, n
+  slli t0, a0, 20
+  addi t1, x0, 1285
+  slli t1, t1, 8
+  addi t1, t1, 19                 # addi a0, a0, 0
+  add t0, t0, t1
+  addi t2, x0, 8                  # word address of site
+  .insn s 0x43, 2, t0, 0(t2)      # sw t0, 0(t2)
+  fence.i
+site:
+  addi x0, x0, 0                  # replaced by every lane
+
+  # sum 1..a0
+  addi t1, x0, 0
+loop:
+  beq a0, x0, . - 8               # -> done
+  add t1, t1, a0
+  addi a0, a0, -1
+  beq x0, x0, . - 18              # -> loop
+done:
+  addi a0, t1, 0
+  addi a7, x0, 93
+  ecall
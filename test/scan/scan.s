@@ -0,0 +1,80 @@
+# Scan loops in the shape of strlen (stop at 0), memchr (stop at a given
+# byte) and a span over equal words, each run as one bulk search.
+#
+# Exits with 0 on success, 1 if memory is wrong and 2 if the
+# instruction count differs from the interpreted loop.
+#
+# Stores use the emulator's store opcode (0x43) and branch offsets follow
+# Registers::increment_pc_by_offset, so both are written out by hand.
+.text
+  .global _start
+
+_start:
+  # src[i] = 1 + i; the stored value changes, so this loop is interpreted
+  addi t0, x0, 1024               # src
+  addi t1, x0, 1088               # end of src
+  addi t2, x0, 1
+  addi x0, x0, 0                  # keeps the next label on an even word
+init:
+  .insn s 0x43, 2, t2, 0(t0)      # sw t2, 0(t0)
+  addi t2, t2, 1
+  addi t0, t0, 1
+  bne t0, t1, . - 12              # -> init
+
+  # strlen: the word at 1024 + 64 is still 0
+  addi t0, x0, 1023
+  addi x0, x0, 0                  # keeps the next label on an even word
+strlen:
+  addi t0, t0, 1
+  lw t4, 0(t0)
+  bne t4, x0, . - 16              # -> strlen
+  addi t6, x0, 1088
+  bne t0, t6, . + 16              # -> fail
+
+  # memchr: first byte equal to 40 from 1024
+  addi t0, x0, 1024
+  addi t2, x0, 40
+  addi x0, x0, 0                  # keeps the next label on an even word
+memchr:
+  lbu t4, 0(t0)
+  addi t0, t0, 1
+  bne t4, t2, . - 24              # -> memchr
+  addi t6, x0, 1064
+  bne t0, t6, . + 0               # -> fail
+
+  # span: skip the zero words after src up to a marker at 1024 + 84
+  addi t0, x0, 1108
+  addi t2, x0, 1
+  .insn s 0x43, 2, t2, 0(t0)      # sw t2, 0(t0)
+  addi t0, x0, 1088
+  addi x0, x0, 0                  # keeps the next label on an even word
+span:
+  lw t4, 0(t0)
+  addi t0, t0, 1
+  beq t4, x0, . - 34              # -> span
+  addi t6, x0, 1109
+  bne t0, t6, . - 20              # -> fail
+
+  # mtime counts retired instructions; it must match the interpreted count
+  addi t5, x0, 1
+  slli t5, t5, 25                 # CLINT 0x02000000
+  addi t6, x0, 767
+  slli t6, t6, 4
+  addi t6, t6, 14                 # mtime at word 0x2FFE
+  add t5, t5, t6
+  lw a1, 0(t5)
+  addi t6, x0, 661
+  bne a1, t6, . - 34              # -> bad_count
+  addi a0, x0, 0
+  addi a7, x0, 93
+  ecall
+  addi x0, x0, 0                  # keeps the next label on an even word
+fail:
+  addi a0, x0, 1
+  addi a7, x0, 93
+  ecall
+  addi x0, x0, 0                  # keeps the next label on an even word
+bad_count:
+  addi a0, x0, 2
+  addi a7, x0, 93
+  ecall
@@ -0,0 +1,48 @@
+# Stores that rewrite already decoded instructions: one in the running
+# block right ahead of the pc and one behind it, re-run after FENCE.I.
+#
+# Exits with 0 on success, 1 if a stale instruction ran.
+#
+# Stores use the emulator's store opcode (0x43) and branch offsets follow
+# Registers::increment_pc_by_offset, so both are written out by hand.
+.text
+  .global _start
+
+_start:
+  addi s0, x0, 0                  # pass
+  addi x0, x0, 0                  # keeps the next label on an even word
+site:
+  addi a0, x0, 1                  # patched to addi a0, x0, 7
+  bne s0, x0, . + 12              # -> second
+  addi s0, x0, 1
+
+  # ahead: rewrite `late` in this block before reaching it
+  addi t0, x0, 9
+  slli t0, t0, 20
+  addi t0, t0, 1427               # addi a1, x0, 9
+  addi t1, x0, 10                 # word address of late
+  .insn s 0x43, 2, t0, 0(t1)      # sw t0, 0(t1)
+late:
+  addi a1, x0, 1                  # patched to addi a1, x0, 9
+  addi t2, x0, 9
+  bne a1, t2, . + 0               # -> fail
+
+  # behind: rewrite `site`, then go back through FENCE.I
+  addi t0, x0, 7
+  slli t0, t0, 20
+  addi t0, t0, 1299               # addi a0, x0, 7
+  addi t1, x0, 2                  # word address of site
+  .insn s 0x43, 2, t0, 0(t1)      # sw t0, 0(t1)
+  fence.i
+  beq x0, x0, . - 38              # -> site
+second:
+  addi t2, x0, 7
+  bne a0, t2, . - 18              # -> fail
+  addi a0, x0, 0
+  addi a7, x0, 93
+  ecall
+  addi x0, x0, 0                  # keeps the next label on an even word
+fail:
+  addi a0, x0, 1
+  addi a7, x0, 93
+  ecall
@@ -0,0 +1,74 @@
+# Drives the memory mapped devices: prints "hello\nworld" (no trailing
+# newline) through the UART, writes CLINT mtimecmp and reads it back,
+# then stops through the test device.
+#
+# Exits with 3 on success, 1 if LSR does not report an empty transmitter
+# and 2 if mtimecmp reads back wrong. The output must be exactly
+# "hello\nworld", so the line left in the UART buffer is flushed at exit.
+#
+# Stores use the emulator's store opcode (0x43) and branch offsets follow
+# Registers::increment_pc_by_offset, so both are written out by hand.
+.text
+  .global _start
+
+_start:
+  addi t0, x0, 1
+  slli t0, t0, 28                 # UART, 0x10000000
+  lw t1, 5(t0)                    # LSR
+  addi t2, x0, 96                 # THRE | TEMT
+  addi a0, x0, 1
+  bne t1, t2, . + 32              # -> report
+  addi t1, x0, 104                # h
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 101                # e
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 108                # l
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 108                # l
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 111                # o
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 10                 # \n
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 119                # w
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 111                # o
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 114                # r
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 108                # l
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+  addi t1, x0, 100                # d
+  .insn s 0x43, 0, t1, 0(t0)      # sb t1, 0(t0)  THR
+
+  addi s0, x0, 1
+  slli s0, s0, 25                 # CLINT, 0x02000000
+  addi t3, x0, 1
+  slli t3, t3, 12
+  add s0, s0, t3                  # mtimecmp, CLINT + 0x1000
+  addi t1, x0, 1234
+  .insn s 0x43, 2, t1, 0(s0)      # sw t1, 0(s0)
+  addi t2, x0, 5
+  .insn s 0x43, 2, t2, 1(s0)      # sw t2, 1(s0)  mtimecmph
+  addi a0, x0, 2
+  lw t3, 0(s0)
+  bne t3, t1, . - 36              # -> report
+  lw t3, 1(s0)
+  bne t3, t2, . - 40              # -> report
+  addi a0, x0, 3
+
+  # test device, 0x10100000: FAIL | a0 << 16
+  addi x0, x0, 0                  # keeps the next label on an even word
+report:
+  addi t0, x0, 257
+  slli t0, t0, 20
+  slli t1, a0, 16
+  addi t2, x0, 819
+  slli t2, t2, 4
+  addi t2, t2, 3                  # 0x3333
+  add t1, t1, t2
+  .insn s 0x43, 2, t1, 0(t0)      # sw t1, 0(t0)
+  # only reached if the test device did not stop the emulator
+  addi a0, x0, 4
+  addi a7, x0, 93
+  ecall